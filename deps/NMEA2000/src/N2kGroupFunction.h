@@ -0,0 +1,17 @@
+#ifndef STUB_GF
+#define STUB_GF
+#include "N2kMsg.h"
+class tNMEA2000;
+enum tN2kGroupFunctionPGNErrorCode { N2kgfPGNec_Acknowledge=0, N2kgfPGNec_PGNNotSupported=1, N2kgfPGNec_PGNTemporarilyNotAvailable=2, N2kgfPGNec_AccessDenied=3 };
+enum tN2kGroupFunctionTransmissionOrPriorityErrorCode { N2kgfTPec_Acknowledge=0, N2kgfTPec_TransmitIntervalOrPriorityNotSupported=1, N2kgfTPec_TransmitIntervalIsLessThanMeasurementInterval=2, N2kgfTPec_AccessDenied=3 };
+enum tN2kGroupFunctionParameterErrorCode { N2kgfpec_Acknowledge=0 };
+class tN2kGroupFunctionHandler { public:
+  tN2kGroupFunctionHandler(tNMEA2000 *_pNMEA2000, unsigned long _PGN){}
+  virtual ~tN2kGroupFunctionHandler(){}
+protected:
+  virtual bool HandleRequest(const tN2kMsg &N2kMsg, uint32_t TransmissionInterval, uint16_t TransmissionIntervalOffset, uint8_t NumberOfParameterPairs, int iDev){return false;}
+  virtual bool HandleCommand(const tN2kMsg &N2kMsg, uint8_t PrioritySetting, uint8_t NumberOfParameterPairs, int iDev){return false;}
+  static void SendAcknowledge(tNMEA2000 *pNMEA2000, unsigned char Destination, int iDev, unsigned long PGN, tN2kGroupFunctionPGNErrorCode PGNErrorCode, tN2kGroupFunctionTransmissionOrPriorityErrorCode TransmissionOrPriorityErrorCode, uint8_t NumberOfParameterPairs=0, tN2kGroupFunctionParameterErrorCode ParameterErrorCode=N2kgfpec_Acknowledge){}
+  tNMEA2000 *pNMEA2000;
+};
+#endif
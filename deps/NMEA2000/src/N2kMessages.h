@@ -0,0 +1,7 @@
+#ifndef STUB_N2KMESSAGES
+#define STUB_N2KMESSAGES
+#include "N2kMsg.h"
+enum tN2kDCType { N2kDCt_Battery=0 };
+void SetN2kPGN127508(tN2kMsg&, unsigned char, double, double, double, unsigned char);
+void SetN2kPGN127506(tN2kMsg&, unsigned char, unsigned char, tN2kDCType, unsigned char, unsigned char, double, double, double);
+#endif
@@ -0,0 +1,30 @@
+#ifndef STUB_N2KMSG
+#define STUB_N2KMSG
+#include <stdint.h>
+#include <string.h>
+#define N2kDoubleNA -1e9
+#define N2kUInt8NA 0xff
+#define N2kInt8NA 0x7f
+#define N2kUInt32NA 0xffffffff
+#define N2kUInt16NA 0xffff
+#define N2kInt32NA 0x7fffffff
+#define N2kMaxCanBusFrameLength 8
+unsigned long millis();
+class tN2kMsg { public:
+  tN2kMsg(unsigned char src=15, unsigned char prio=6, unsigned long pgn=0, int len=0){}
+  unsigned long PGN; unsigned char Priority; unsigned char Source; unsigned char Destination; int DataLen; unsigned char Data[223];
+  void Init(unsigned char, unsigned long, unsigned char, unsigned char){}
+  void AddByte(unsigned char){}
+  void Add4ByteUInt(uint32_t){}
+  void Add2ByteUInt(uint16_t){}
+  void AddUInt64(uint64_t){}
+  void Add3ByteInt(int32_t){}
+  void AddStr(const char*, int){}
+  uint8_t GetByte(int &i) const {return 0;}
+  uint16_t Get2ByteUInt(int &i, uint16_t def=0xffff) const {return 0;}
+  uint32_t Get4ByteUInt(int &i, uint32_t def=0xffffffff) const {return 0;}
+  uint32_t Get3ByteUInt(int &i, uint32_t def=0xffffffff) const {return 0;}
+  bool IsValid() const {return true;}
+  void SetIsTPMessage(bool tp=true){}
+};
+#endif
@@ -0,0 +1,30 @@
+#ifndef STUB_NMEA2000
+#define STUB_NMEA2000
+#include "N2kMsg.h"
+#include "N2kGroupFunction.h"
+class tNMEA2000 { public:
+  enum tN2kMode { N2km_ListenOnly, N2km_NodeOnly, N2km_ListenAndNode };
+  virtual ~tNMEA2000(){}
+  void SetN2kCANSendFrameBufSize(uint16_t){}
+  void SetN2kCANReceiveFrameBufSize(uint16_t){}
+  void SetN2kCANMsgBufSize(uint8_t){}
+  void SetProductInformation(const char*, unsigned short, const char*, const char*, const char*, unsigned char LoadEquivalency=0xff, unsigned short N2kVersion=0xffff, unsigned char CertificationLevel=0xff, int iDev=0){}
+  void SetDeviceInformation(unsigned long, unsigned char, unsigned char, uint16_t, unsigned char IndustryGroup=4, int iDev=0){}
+  void SetMode(tN2kMode, uint8_t){}
+  void EnableForward(bool){}
+  void SetMsgHandler(void (*)(const tN2kMsg&)){}
+  bool Open(){return true;}
+  bool SendMsg(const tN2kMsg&, int DeviceIndex=0){return true;}
+  void ParseMessages(){}
+  uint8_t GetN2kSource(int iDev=0) const {return 0;}
+  void ExtendTransmitMessages(const unsigned long*, int iDev=0){}
+  void ExtendReceiveMessages(const unsigned long*, int iDev=0){}
+  void AddGroupFunctionHandler(tN2kGroupFunctionHandler*){}
+  void SetOnOpen(void (*)()){}
+protected:
+  virtual bool CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent=true)=0;
+  virtual bool CANOpen()=0;
+  virtual bool CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf)=0;
+  virtual void InitCANFrameBuffers(){}
+};
+#endif
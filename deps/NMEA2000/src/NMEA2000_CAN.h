@@ -0,0 +1,2 @@
+#include "NMEA2000_SocketCAN.h"
+static tNMEA2000 &NMEA2000=*(new tNMEA2000_SocketCAN(SOCKET_CAN_PORT));
@@ -0,0 +1,11 @@
+#ifndef STUB_SC
+#define STUB_SC
+#include "NMEA2000.h"
+class tNMEA2000_SocketCAN : public tNMEA2000 { public:
+  tNMEA2000_SocketCAN(char* CANport=0){}
+protected:
+  bool CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent=true){return true;}
+  bool CANOpen(){return true;}
+  bool CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf){return false;}
+};
+#endif
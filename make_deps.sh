@@ -13,7 +13,6 @@
 
 DEPS_DIR="./deps"
 DEPS_NMEA2000="NMEA2000"
-DEPS_NMEA2000_SOCKETCAN="NMEA2000_socketCAN"
 
 if [ ! -d "$DEPS_DIR" ]; then
   # Take action if $DIR exists. #
@@ -53,47 +52,12 @@ if [ ! -d "./build" ]; then
 	mkdir "./build"
 fi
 cd "./build"
-echo "Make dependency $DEPS_NMEA2000"A
+echo "Make dependency $DEPS_NMEA2000"
 cmake ..
 make nmea2000
 
-#back to deps directory
-cd ../..
-
-if [ ! -d "$DEPS_NMEA2000_SOCKETCAN" ]; then
-	echo "Downloading dependency $DEPS_NMEA2000_SOCKETCAN..."
-	git clone https://github.com/ttlappalainen/NMEA2000_socketCAN.git
-	cd "$DEPS_NMEA2000_SOCKETCAN"
-else
-	echo "Updating dependency $DEPS_NMEA2000_SOCKETCAN..."
-	cd "$DEPS_NMEA2000_SOCKETCAN"
-	#git reset --hard
-	git pull
-fi
-
-if [ ! -d "CMakeLists.txt" ]; then
-	echo "Creating build files for socketcan library..."
-	echo "cmake_minimum_required(VERSION 3.0)" > CMakeLists.txt
-	echo "project(NMEA2000_SOCKETCAN)" >> CMakeLists.txt
-	echo "add_compile_options(" >> CMakeLists.txt
-	echo "  -Wall" >> CMakeLists.txt
-	echo "  -Werror" >> CMakeLists.txt
-	echo "  -std=c++11" >> CMakeLists.txt
-	echo "  -g" >> CMakeLists.txt
-	echo ")" >> CMakeLists.txt
-	echo "add_library(nmea2000_socketcan" >> CMakeLists.txt
-	echo "  NMEA2000_SocketCAN.cpp" >> CMakeLists.txt
-	echo ")" >> CMakeLists.txt
-	echo "target_include_directories(nmea2000_socketcan" >> CMakeLists.txt
-	echo "  PUBLIC" >> CMakeLists.txt
-	echo "  ${CMAKE_CURRENT_SOURCE_DIR}" >> CMakeLists.txt
-	echo ")" >> CMakeLists.txt
-	echo "include_directories(../NMEA2000/src)" >> CMakeLists.txt
+# src/CMakeLists.txt links this; the socketCAN backend is our own (src/N2KSocketCAN.cpp)
+if [ ! -f "./src/libnmea2000.a" ]; then
+	echo "Building $DEPS_NMEA2000 failed"
+	exit 1
 fi
-cmake .
-make
-
-
-
-
-
@@ -0,0 +1,139 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Alloc.h"
+#include <stdlib.h>
+#include <atomic>
+
+#ifdef VEDIRECT_ALLOC_TRACKING
+
+#include <new>
+#ifndef ESP32_ARCH
+#include <unistd.h>
+#endif
+
+static std::atomic<bool> armed(false);
+static std::atomic<bool> abort_on_alloc(false);
+static std::atomic<unsigned long> count(0);
+
+static void on_alloc()
+{
+    if (!armed.load(std::memory_order_relaxed))
+        return;
+    count.fetch_add(1, std::memory_order_relaxed);
+    if (abort_on_alloc.load(std::memory_order_relaxed))
+    {
+        // no printf here, it may allocate
+        static const char msg[] = "Heap allocation after startup, aborting\n";
+#ifndef ESP32_ARCH
+        if (write(2, msg, sizeof(msg) - 1) < 0)
+            abort();
+#endif
+        abort();
+    }
+}
+
+#if !defined(ESP32_ARCH) && defined(__GLIBC__)
+// glibc: catch malloc itself, so that strdup, stdio and operator new are all counted
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t n, size_t size);
+    void *__libc_realloc(void *p, size_t size);
+
+    void *malloc(size_t size)
+    {
+        on_alloc();
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t n, size_t size)
+    {
+        on_alloc();
+        return __libc_calloc(n, size);
+    }
+
+    void *realloc(void *p, size_t size)
+    {
+        on_alloc();
+        return __libc_realloc(p, size);
+    }
+}
+#else
+// elsewhere only operator new can be hooked
+void *operator new(size_t size)
+{
+    on_alloc();
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        abort();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+#endif
+
+void Alloc::arm(bool _abort_on_alloc)
+{
+    // the count goes on across disarm/arm (setup work on a reload is not counted)
+    abort_on_alloc.store(_abort_on_alloc, std::memory_order_relaxed);
+    armed.store(true, std::memory_order_release);
+}
+
+void Alloc::disarm()
+{
+    armed.store(false, std::memory_order_release);
+}
+
+unsigned long Alloc::get_count()
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+bool Alloc::is_tracking()
+{
+    return true;
+}
+
+#else
+
+void Alloc::arm(bool _abort_on_alloc) {}
+
+void Alloc::disarm() {}
+
+unsigned long Alloc::get_count()
+{
+    return 0;
+}
+
+bool Alloc::is_tracking()
+{
+    return false;
+}
+
+#endif
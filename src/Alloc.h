@@ -0,0 +1,35 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+// heap accounting for the no-heap-after-startup mode
+// all the memory is reserved during setup; once armed, every heap allocation is
+// counted (and optionally aborts the process). The hooks are only compiled in
+// with VEDIRECT_ALLOC_TRACKING, otherwise the counter always reads 0.
+class Alloc
+{
+public:
+    static void arm(bool abort_on_alloc = false);
+    static void disarm();
+
+    // heap allocations while armed, since startup
+    static unsigned long get_count();
+
+    static bool is_tracking();
+};
+
+#endif
@@ -0,0 +1,432 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Archive.h"
+#include "Log.h"
+#include <string.h>
+#include <errno.h>
+
+// worst case: 10 bytes per varint, one per column and per sample
+#define ARCHIVE_BLOCK_BUFFER_SIZE (ARCHIVE_BLOCK_SAMPLES * (ARCHIVE_COLUMNS + 1) * 10 + 16)
+
+static unsigned char block_buffer[ARCHIVE_BLOCK_BUFFER_SIZE];
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+class StreamEncoder
+{
+public:
+    StreamEncoder(unsigned char *_buffer) : buffer(_buffer), len(0), zeros(0) {}
+
+    void varint(uint64_t v)
+    {
+        do
+        {
+            unsigned char b = v & 0x7F;
+            v >>= 7;
+            buffer[len++] = v ? (b | 0x80) : b;
+        } while (v);
+    }
+
+    void delta(int64_t d)
+    {
+        if (d == 0)
+        {
+            zeros++;
+        }
+        else
+        {
+            end_run();
+            varint(zigzag(d) << 1);
+        }
+    }
+
+    void end_run()
+    {
+        if (zeros)
+            varint((zeros << 1) | 1);
+        zeros = 0;
+    }
+
+    int get_length() const { return len; }
+
+private:
+    unsigned char *buffer;
+    int len;
+    uint64_t zeros;
+};
+
+class StreamDecoder
+{
+public:
+    StreamDecoder(const unsigned char *_p, int len) : p(_p), end(_p + len), zeros(0), ok(true) {}
+
+    uint64_t varint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64 && p < end; shift += 7)
+        {
+            unsigned char b = *(p++);
+            v |= ((uint64_t)(b & 0x7F)) << shift;
+            if ((b & 0x80) == 0)
+                return v;
+        }
+        ok = false;
+        return 0;
+    }
+
+    int64_t delta()
+    {
+        if (zeros)
+        {
+            zeros--;
+            return 0;
+        }
+        uint64_t t = varint();
+        if (t & 1)
+        {
+            zeros = (t >> 1) - 1;
+            return 0;
+        }
+        return unzigzag(t >> 1);
+    }
+
+    bool is_ok() const { return ok; }
+
+private:
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t zeros;
+    bool ok;
+};
+
+static void init_summary(ArchiveColumnSummary &c)
+{
+    c.min = 0;
+    c.max = 0;
+    c.sum = 0;
+    c.count = 0;
+    c.reserved = 0;
+}
+
+static void add_to_summary(ArchiveColumnSummary &c, int col, int32_t v)
+{
+    if (v == ARCHIVE_NA)
+        return;
+    if (c.count == 0)
+    {
+        c.min = c.max = v;
+    }
+    else if (col == ARCHIVE_FLAGS)
+    {
+        c.min &= v;
+        c.max |= v;
+    }
+    else
+    {
+        if (v < c.min)
+            c.min = v;
+        if (v > c.max)
+            c.max = v;
+    }
+    c.sum += v;
+    c.count++;
+}
+
+static void merge_summary(ArchiveColumnSummary &dst, int col, const ArchiveColumnSummary &src)
+{
+    if (src.count == 0)
+        return;
+    if (dst.count == 0)
+    {
+        dst.min = src.min;
+        dst.max = src.max;
+    }
+    else if (col == ARCHIVE_FLAGS)
+    {
+        dst.min &= src.min;
+        dst.max |= src.max;
+    }
+    else
+    {
+        if (src.min < dst.min)
+            dst.min = src.min;
+        if (src.max > dst.max)
+            dst.max = src.max;
+    }
+    dst.sum += src.sum;
+    dst.count += src.count;
+}
+
+ArchiveWriter::ArchiveWriter() : data(NULL), index(NULL), n_samples(0)
+{
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    close();
+}
+
+bool ArchiveWriter::open(const char *path)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "%s.dat", path);
+    data = fopen(name, "ab");
+    snprintf(name, sizeof(name), "%s.idx", path);
+    index = fopen(name, "ab");
+    if (data == NULL || index == NULL)
+    {
+        Log::trace("Err opening archive {%s} {%d} {%s}\n", path, errno, strerror(errno));
+        close();
+        return false;
+    }
+    // blocks are written whole, a stdio buffer would only be one more lazy allocation
+    setvbuf(data, NULL, _IONBF, 0);
+    setvbuf(index, NULL, _IONBF, 0);
+    Log::trace("Archiving values to {%s}\n", path);
+    return true;
+}
+
+void ArchiveWriter::close()
+{
+    flush();
+    if (data)
+        fclose(data);
+    if (index)
+        fclose(index);
+    data = NULL;
+    index = NULL;
+}
+
+void ArchiveWriter::add(const ArchiveSample &s)
+{
+    if (data == NULL)
+        return;
+    if (n_samples && (s.time < samples[n_samples - 1].time || s.time - samples[0].time >= ARCHIVE_MAX_BLOCK_SPAN))
+        flush(); // also when the clock went back, blocks must not overlap
+    samples[n_samples++] = s;
+    if (n_samples == ARCHIVE_BLOCK_SAMPLES)
+        flush();
+}
+
+void ArchiveWriter::flush()
+{
+    if (data == NULL || n_samples == 0)
+        return;
+
+    ArchiveBlockSummary summary;
+    memset(&summary, 0, sizeof(summary));
+    summary.t_start = samples[0].time;
+    summary.t_end = samples[n_samples - 1].time;
+    summary.count = n_samples;
+
+    StreamEncoder enc(block_buffer);
+    enc.varint(n_samples);
+
+    // time: absolute, then delta-of-deltas
+    enc.varint(samples[0].time);
+    int64_t last_delta = 0;
+    for (int i = 1; i < n_samples; i++)
+    {
+        int64_t d = (int64_t)(samples[i].time - samples[i - 1].time);
+        enc.delta(d - last_delta);
+        last_delta = d;
+    }
+    enc.end_run();
+
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+    {
+        init_summary(summary.columns[c]);
+        int64_t last = 0;
+        for (int i = 0; i < n_samples; i++)
+        {
+            int32_t v = samples[i].values[c];
+            enc.delta((int64_t)v - last);
+            last = v;
+            add_to_summary(summary.columns[c], c, v);
+        }
+        enc.end_run();
+    }
+
+    fseek(data, 0, SEEK_END);
+    summary.offset = ftell(data);
+    summary.length = enc.get_length();
+    if (fwrite(block_buffer, 1, summary.length, data) != summary.length ||
+        fwrite(&summary, sizeof(summary), 1, index) != 1)
+    {
+        Log::trace("Err writing archive block {%d} {%s}\n", errno, strerror(errno));
+    }
+    // the index entry goes after the data, a crash in between leaves an orphan block at worst
+    fflush(data);
+    fflush(index);
+    n_samples = 0;
+}
+
+ArchiveReader::ArchiveReader() : data(NULL), index(NULL), n_blocks(0), n_samples(0)
+{
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    close();
+}
+
+bool ArchiveReader::open(const char *path)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "%s.dat", path);
+    data = fopen(name, "rb");
+    snprintf(name, sizeof(name), "%s.idx", path);
+    index = fopen(name, "rb");
+    if (data == NULL || index == NULL)
+    {
+        Log::trace("Err opening archive {%s} {%d} {%s}\n", path, errno, strerror(errno));
+        close();
+        return false;
+    }
+    fseek(index, 0, SEEK_END);
+    n_blocks = ftell(index) / sizeof(ArchiveBlockSummary);
+    return true;
+}
+
+void ArchiveReader::close()
+{
+    if (data)
+        fclose(data);
+    if (index)
+        fclose(index);
+    data = NULL;
+    index = NULL;
+}
+
+long ArchiveReader::find_first_block(uint64_t from)
+{
+    // first block ending at or after "from"
+    long lo = 0, hi = n_blocks;
+    ArchiveBlockSummary s;
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        fseek(index, mid * sizeof(ArchiveBlockSummary), SEEK_SET);
+        if (fread(&s, sizeof(s), 1, index) != 1)
+            return n_blocks;
+        if (s.t_end < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool ArchiveReader::decode_block(const ArchiveBlockSummary &summary)
+{
+    if (summary.length > ARCHIVE_BLOCK_BUFFER_SIZE || summary.count > ARCHIVE_BLOCK_SAMPLES)
+        return false;
+    fseek(data, summary.offset, SEEK_SET);
+    if (fread(block_buffer, 1, summary.length, data) != summary.length)
+        return false;
+
+    StreamDecoder dec(block_buffer, summary.length);
+    n_samples = dec.varint();
+    if (n_samples != (int)summary.count)
+        return false;
+
+    samples[0].time = dec.varint();
+    int64_t last_delta = 0;
+    for (int i = 1; i < n_samples; i++)
+    {
+        last_delta += dec.delta();
+        samples[i].time = samples[i - 1].time + last_delta;
+    }
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+    {
+        int64_t last = 0;
+        for (int i = 0; i < n_samples; i++)
+        {
+            last += dec.delta();
+            samples[i].values[c] = (int32_t)last;
+        }
+    }
+    return dec.is_ok();
+}
+
+int ArchiveReader::query(uint64_t from, uint64_t to, uint64_t resolution, void (*fun)(const ArchiveBucket &b, void *ctx), void *ctx)
+{
+    if (data == NULL || from >= to)
+        return 0;
+    if (resolution == 0)
+        resolution = 1;
+
+    int decoded = 0;
+    ArchiveBucket bucket;
+    bool has_bucket = false;
+
+#define BUCKET_OF(t) (from + ((t) - from) / resolution * resolution)
+#define SWITCH_BUCKET(t)                                     \
+    if (!has_bucket || bucket.time != (t))                   \
+    {                                                        \
+        if (has_bucket && bucket.count)                      \
+            fun(bucket, ctx);                                \
+        memset(&bucket, 0, sizeof(bucket));                  \
+        bucket.time = (t);                                   \
+        has_bucket = true;                                   \
+    }
+
+    ArchiveBlockSummary s;
+    for (long b = find_first_block(from); b < n_blocks; b++)
+    {
+        fseek(index, b * sizeof(ArchiveBlockSummary), SEEK_SET);
+        if (fread(&s, sizeof(s), 1, index) != 1 || s.t_start >= to)
+            break;
+
+        if (s.t_start >= from && s.t_end < to && BUCKET_OF(s.t_start) == BUCKET_OF(s.t_end))
+        {
+            // the whole block falls in one step: the summary is enough
+            SWITCH_BUCKET(BUCKET_OF(s.t_start));
+            for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+                merge_summary(bucket.columns[c], c, s.columns[c]);
+            bucket.count += s.count;
+            continue;
+        }
+
+        if (!decode_block(s))
+        {
+            Log::trace("Corrupted archive block {%ld}, skipped\n", b);
+            continue;
+        }
+        decoded++;
+        for (int i = 0; i < n_samples; i++)
+        {
+            const ArchiveSample &x = samples[i];
+            if (x.time < from || x.time >= to)
+                continue;
+            SWITCH_BUCKET(BUCKET_OF(x.time));
+            for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+                add_to_summary(bucket.columns[c], c, x.values[c]);
+            bucket.count++;
+        }
+    }
+    if (has_bucket && bucket.count)
+        fun(bucket, ctx);
+    return decoded;
+}
@@ -0,0 +1,131 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+Long term archive of the ve.direct values, two append-only files:
+  <path>.dat  compressed blocks of up to ARCHIVE_BLOCK_SAMPLES samples
+  <path>.idx  one fixed size ArchiveBlockSummary per block (time range, location, min/max/sum per column)
+
+Block layout: <count: varint> then one stream per column. The time column starts
+with the absolute time and continues with delta-of-deltas, the value columns
+are deltas from the previous sample. Each stream is a sequence of varint tokens:
+odd tokens are runs of (token >> 1) zero deltas, even tokens carry one zigzag
+encoded delta (token >> 1), so steady values cost almost nothing.
+
+Queries at a resolution coarser than a block only read the index. Files are
+written in the host byte order.
+*/
+
+#define ARCHIVE_BLOCK_SAMPLES 1024
+#define ARCHIVE_MAX_BLOCK_SPAN 600000 // ms, flush a block at least every 10 minutes
+#define ARCHIVE_NA INT32_MIN
+
+enum ArchiveColumn
+{
+    ARCHIVE_V,     // mV
+    ARCHIVE_VS,    // mV
+    ARCHIVE_I,     // mA
+    ARCHIVE_SOC,   // 1/1000
+    ARCHIVE_CE,    // mAh
+    ARCHIVE_T,     // C
+    ARCHIVE_FLAGS, // bit 0 alarm, bit 1 relay, bits 2+ alarm reason
+    ARCHIVE_COLUMNS
+};
+
+struct ArchiveSample
+{
+    uint64_t time; // ms since epoch
+    int32_t values[ARCHIVE_COLUMNS];
+};
+
+struct ArchiveColumnSummary
+{
+    int32_t min; // AND of the values for the flags
+    int32_t max; // OR of the values for the flags
+    int64_t sum;
+    uint32_t count; // samples with a value (not ARCHIVE_NA)
+    uint32_t reserved;
+};
+
+struct ArchiveBlockSummary
+{
+    uint64_t t_start;
+    uint64_t t_end;
+    uint64_t offset; // in the .dat file
+    uint32_t length; // bytes in the .dat file
+    uint32_t count;  // samples in the block
+    ArchiveColumnSummary columns[ARCHIVE_COLUMNS];
+};
+
+// aggregated values over one query step
+struct ArchiveBucket
+{
+    uint64_t time; // start of the step
+    uint32_t count;
+    ArchiveColumnSummary columns[ARCHIVE_COLUMNS];
+};
+
+class ArchiveWriter
+{
+public:
+    ArchiveWriter();
+    ~ArchiveWriter();
+
+    bool open(const char *path);
+    void close();
+
+    void add(const ArchiveSample &s);
+
+    // write the pending block, if any
+    void flush();
+
+private:
+    FILE *data;
+    FILE *index;
+    ArchiveSample samples[ARCHIVE_BLOCK_SAMPLES];
+    int n_samples;
+};
+
+class ArchiveReader
+{
+public:
+    ArchiveReader();
+    ~ArchiveReader();
+
+    bool open(const char *path);
+    void close();
+
+    // aggregate [from, to) in steps of "resolution" ms, calls "fun" for each non empty step
+    // returns the number of blocks decoded (the others were answered from the index)
+    int query(uint64_t from, uint64_t to, uint64_t resolution, void (*fun)(const ArchiveBucket &b, void *ctx), void *ctx);
+
+private:
+    long find_first_block(uint64_t from);
+    bool decode_block(const ArchiveBlockSummary &summary);
+
+    FILE *data;
+    FILE *index;
+    long n_blocks;
+    ArchiveSample samples[ARCHIVE_BLOCK_SAMPLES];
+    int n_samples;
+};
+
+#endif
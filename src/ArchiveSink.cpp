@@ -0,0 +1,47 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESP32_ARCH
+
+#include "ArchiveSink.h"
+#include <math.h>
+#include "Utils.h"
+
+// back to the resolution of the ve.direct fields
+static int32_t to_raw(double v, double precision)
+{
+    return (v == N2kDoubleNA) ? ARCHIVE_NA : (int32_t)lround(v / precision);
+}
+
+void ArchiveSink::publish(const BatteryReading &r, const BatteryStats &stats, unsigned char instance, unsigned char instance_e)
+{
+    if (instance != ArchiveSink::instance)
+        return;
+    ArchiveSample s;
+    s.time = _wall_millis();
+    s.values[ARCHIVE_V] = to_raw(r.voltage, 0.001);
+    s.values[ARCHIVE_VS] = to_raw(r.voltage1, 0.001);
+    s.values[ARCHIVE_I] = to_raw(r.current, 0.001);
+    s.values[ARCHIVE_SOC] = to_raw(r.soc, 0.1);
+    s.values[ARCHIVE_CE] = to_raw(r.consumed, 0.001);
+    s.values[ARCHIVE_T] = to_raw(r.temperature, 1);
+    if (r.alarm < 0 && r.relay < 0 && r.alarm_reason < 0)
+        s.values[ARCHIVE_FLAGS] = ARCHIVE_NA;
+    else
+        s.values[ARCHIVE_FLAGS] = (r.alarm > 0 ? 1 : 0) | (r.relay > 0 ? 2 : 0) | ((r.alarm_reason > 0 ? r.alarm_reason : 0) << 2);
+    writer.add(s);
+}
+
+#endif
@@ -0,0 +1,47 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARCHIVE_SINK_H
+#define ARCHIVE_SINK_H
+
+#ifndef ESP32_ARCH
+
+#include "OutputSink.h"
+#include "Archive.h"
+
+// appends the readings of one N2K instance to the long term archive
+class ArchiveSink : public OutputSink
+{
+public:
+    ArchiveSink() : instance(0) {}
+
+    bool open(const char *path, unsigned char _instance)
+    {
+        instance = _instance;
+        return writer.open(path);
+    }
+    void close() { writer.close(); }
+
+    void publish(const BatteryReading &r, const BatteryStats &stats, unsigned char instance, unsigned char instance_e);
+    void flush() {}
+
+private:
+    ArchiveWriter writer;
+    unsigned char instance;
+};
+
+#endif
+
+#endif
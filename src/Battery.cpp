@@ -0,0 +1,56 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Battery.h"
+#include "Utils.h"
+
+void BatteryReading::load(VEDirectObject &obj, unsigned long _frame, unsigned long _time)
+{
+    frame = _frame;
+    device = 0;
+    time = _time;
+    stamp = _micros();
+    voltage = N2kDoubleNA;
+    voltage1 = N2kDoubleNA;
+    current = N2kDoubleNA;
+    soc = N2kDoubleNA;
+    temperature = N2kDoubleNA;
+    ttg = N2kDoubleNA;
+    consumed = N2kDoubleNA;
+    obj.get_number_value(voltage, 0.001, BMV_VOLTAGE); // convert in V from mV
+    obj.get_number_value(voltage1, 0.001, BMV_VOLTAGE_1); // convert in V from mV
+    obj.get_number_value(current, 0.001, BMV_CURRENT); // convert in A from mA
+    obj.get_number_value(soc, 0.1, BMV_SOC); // convert in percentage from 1000ths
+    obj.get_number_value(temperature, 1, BMV_TEMPERATURE); // celsius
+    obj.get_number_value(consumed, 0.001, BMV_CONSUMPTION); // convert in Ah from mAh
+
+    int ttg_minutes;
+    if (obj.get_number_value(ttg_minutes, BMV_TIME_TO_GO) && ttg_minutes >= 0) // -1 means infinite
+        ttg = ttg_minutes * 60.0;
+
+    raw_valid = 0;
+    for (unsigned int i = 0; i < BMV_N_FIELDS; i++)
+    {
+        raw[i] = 0;
+        if (BMV_FIELDS[i].veType != VE_STRING && obj.get_number_value(raw[i], BMV_FIELDS[i].veIndex))
+            raw_valid |= (1 << i);
+    }
+
+    bool b;
+    alarm = obj.get_boolean_value(b, BMV_ALARM) ? (b ? 1 : 0) : -1;
+    relay = obj.get_boolean_value(b, BMV_RELAY) ? (b ? 1 : 0) : -1;
+    if (!obj.get_number_value(alarm_reason, BMV_ALARM_REASON))
+        alarm_reason = -1;
+}
@@ -0,0 +1,45 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include <N2kMessages.h>
+#include "VeDirect.h"
+
+// validated snapshot of a ve.direct frame, in SI units (N2kDoubleNA when missing)
+struct BatteryReading
+{
+    unsigned long frame;  // progressive number of the frame
+    unsigned int device;  // index of the monitor that sent it
+    unsigned long time;   // ms (_millis(), not a date), when the frame was validated
+    unsigned long stamp;  // us (monotonic), when the frame was validated, for latency measurements
+    double voltage;       // V
+    double voltage1;      // V, auxiliary/starter battery
+    double current;       // A
+    double soc;           // %
+    double temperature;   // C
+    double ttg;           // s
+    double consumed;      // Ah
+    int alarm;            // 1/0, -1 if not available
+    int relay;            // 1/0, -1 if not available
+    int alarm_reason;     // -1 if not available
+    int raw[BMV_N_FIELDS]; // ve.direct values as received (by field index), for the N2K mapping
+    unsigned int raw_valid; // bit per field, set if received
+
+    void load(VEDirectObject &obj, unsigned long frame, unsigned long time);
+};
+
+#endif
@@ -0,0 +1,210 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BatteryAnalytics.h"
+#include <math.h>
+#include <stdio.h>
+
+#define IS_NA(x) ((x) == N2kDoubleNA)
+
+RollingWindow::RollingWindow()
+{
+    clear();
+}
+
+void RollingWindow::clear()
+{
+    seq = 0;
+    n = 0;
+    sum = 0;
+    min_head = min_tail = 0;
+    max_head = max_tail = 0;
+}
+
+void RollingWindow::add(double v)
+{
+    unsigned long s = seq++;
+    int slot = s % ANALYTICS_WINDOW;
+
+    // drop the sample leaving the window, from the sum and from the queues
+    if (n == ANALYTICS_WINDOW)
+        sum -= values[slot];
+    else
+        n++;
+    while (min_head != min_tail && min_q[min_head % ANALYTICS_WINDOW] + ANALYTICS_WINDOW <= s)
+        min_head++;
+    while (max_head != max_tail && max_q[max_head % ANALYTICS_WINDOW] + ANALYTICS_WINDOW <= s)
+        max_head++;
+
+    values[slot] = v;
+    sum += v;
+
+    while (min_head != min_tail && values[min_q[(min_tail - 1) % ANALYTICS_WINDOW] % ANALYTICS_WINDOW] >= v)
+        min_tail--;
+    min_q[min_tail++ % ANALYTICS_WINDOW] = s;
+    while (max_head != max_tail && values[max_q[(max_tail - 1) % ANALYTICS_WINDOW] % ANALYTICS_WINDOW] <= v)
+        max_tail--;
+    max_q[max_tail++ % ANALYTICS_WINDOW] = s;
+
+    if (slot == ANALYTICS_WINDOW - 1)
+    {
+        // once per lap, get rid of the rounding errors accumulated by the running sum
+        sum = 0;
+        for (int i = 0; i < n; i++)
+            sum += values[i];
+    }
+}
+
+BatteryAnalytics::BatteryAnalytics(double _nominal_capacity, unsigned char instance)
+    : nominal_capacity(_nominal_capacity), last_time(0), last_current(0), last_power(0), has_last(false),
+      anchor_soc(0), anchor_ah(0), has_anchor(false),
+      m_current_ewma("battery_current_smoothed_amperes", "Battery current, exponentially smoothed"),
+      m_power_ewma("battery_power_smoothed_watts", "Battery power, exponentially smoothed"),
+      m_ah_in("battery_charged_ah", "Charge into the battery since start"),
+      m_ah_out("battery_discharged_ah", "Charge out of the battery since start"),
+      m_wh_in("battery_charged_wh", "Energy into the battery since start"),
+      m_wh_out("battery_discharged_wh", "Energy out of the battery since start"),
+      m_ttg("battery_time_to_go_seconds", "Estimated time to go at the smoothed discharge rate"),
+      m_capacity("battery_capacity_estimate_ah", "Estimated usable capacity")
+{
+    stats.current_mean = stats.current_min = stats.current_max = stats.current_ewma = 0;
+    stats.power_mean = stats.power_min = stats.power_max = stats.power_ewma = 0;
+    stats.ah_in = stats.ah_out = stats.wh_in = stats.wh_out = 0;
+    stats.ttg = N2kDoubleNA;
+    stats.capacity = nominal_capacity;
+    stats.soh = 100;
+
+    set_instance(instance);
+    update_metrics();
+}
+
+void BatteryAnalytics::set_instance(unsigned char instance)
+{
+    char labels[METRIC_LABELS_SIZE];
+    snprintf(labels, sizeof(labels), "instance=\"%d\"", instance);
+    MetricGauge *gauges[] = {&m_current_ewma, &m_power_ewma, &m_ah_in, &m_ah_out, &m_wh_in, &m_wh_out, &m_ttg, &m_capacity};
+    for (unsigned int i = 0; i < sizeof(gauges) / sizeof(MetricGauge *); i++)
+        gauges[i]->set_labels(labels);
+}
+
+void BatteryAnalytics::set_nominal_capacity(double capacity)
+{
+    nominal_capacity = capacity;
+    stats.capacity = capacity;
+    stats.soh = 100;
+    has_anchor = false;
+    update_metrics();
+}
+
+void BatteryAnalytics::add(const BatteryReading &r)
+{
+    if (IS_NA(r.current))
+        return;
+
+    double p = IS_NA(r.voltage) ? 0.0 : r.voltage * r.current;
+    current.add(r.current);
+    power.add(p);
+
+    double dt = has_last ? (r.time - last_time) / 1000.0 : 0.0;
+    if (has_last && dt > 0 && dt <= ANALYTICS_MAX_GAP)
+    {
+        // trapezoidal integration between the last two samples
+        double ah = (r.current + last_current) / 2.0 * dt / 3600.0;
+        double wh = (p + last_power) / 2.0 * dt / 3600.0;
+        if (ah > 0)
+            stats.ah_in += ah;
+        else
+            stats.ah_out -= ah;
+        if (wh > 0)
+            stats.wh_in += wh;
+        else
+            stats.wh_out -= wh;
+
+        double alpha = 1.0 - exp(-dt / ANALYTICS_EWMA_TAU);
+        stats.current_ewma += alpha * (r.current - stats.current_ewma);
+        stats.power_ewma += alpha * (p - stats.power_ewma);
+    }
+    else
+    {
+        // first sample or after a gap: restart the smoothing and the capacity segment
+        stats.current_ewma = r.current;
+        stats.power_ewma = p;
+        has_anchor = false;
+    }
+    last_time = r.time;
+    last_current = r.current;
+    last_power = p;
+    has_last = true;
+
+    stats.current_mean = current.mean();
+    stats.current_min = current.min();
+    stats.current_max = current.max();
+    stats.power_mean = power.mean();
+    stats.power_min = power.min();
+    stats.power_max = power.max();
+
+    update_capacity(r);
+
+    if (!IS_NA(r.soc) && stats.current_ewma < -ANALYTICS_MIN_DISCHARGE)
+        stats.ttg = (r.soc / 100.0) * stats.capacity / -stats.current_ewma * 3600.0;
+    else
+        stats.ttg = N2kDoubleNA;
+
+    update_metrics();
+}
+
+void BatteryAnalytics::update_capacity(const BatteryReading &r)
+{
+    if (IS_NA(r.soc))
+        return;
+    double net_ah = stats.ah_in - stats.ah_out;
+    if (has_anchor)
+    {
+        double d_soc = anchor_soc - r.soc;
+        if (d_soc >= ANALYTICS_CAPACITY_STEP)
+        {
+            // only discharge segments, charging is skewed by the charge efficiency
+            double estimate = (anchor_ah - net_ah) / (d_soc / 100.0);
+            if (estimate > nominal_capacity * 0.3 && estimate < nominal_capacity * 2.0)
+            {
+                stats.capacity += 0.2 * (estimate - stats.capacity);
+                stats.soh = stats.capacity / nominal_capacity * 100.0;
+            }
+            has_anchor = false;
+        }
+        else if (d_soc < 0)
+        {
+            has_anchor = false; // charging, restart from here
+        }
+    }
+    if (!has_anchor)
+    {
+        anchor_soc = r.soc;
+        anchor_ah = net_ah;
+        has_anchor = true;
+    }
+}
+
+void BatteryAnalytics::update_metrics()
+{
+    m_current_ewma.set(stats.current_ewma);
+    m_power_ewma.set(stats.power_ewma);
+    m_ah_in.set(stats.ah_in);
+    m_ah_out.set(stats.ah_out);
+    m_wh_in.set(stats.wh_in);
+    m_wh_out.set(stats.wh_out);
+    m_ttg.set(IS_NA(stats.ttg) ? NAN : stats.ttg);
+    m_capacity.set(stats.capacity);
+}
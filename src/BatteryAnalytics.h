@@ -0,0 +1,119 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATTERY_ANALYTICS_H
+#define BATTERY_ANALYTICS_H
+
+#include "Battery.h"
+#include "Metrics.h"
+
+#define ANALYTICS_WINDOW 64           // samples in the rolling windows (~1 minute at 1Hz)
+#define ANALYTICS_EWMA_TAU 120.0      // s, time constant of the smoothed current/power
+#define ANALYTICS_MAX_GAP 10.0        // s, longer gaps between samples are not integrated
+#define ANALYTICS_MIN_DISCHARGE 0.2   // A, below this the battery is considered idle (no TTG)
+#define ANALYTICS_CAPACITY_STEP 10.0  // SOC points needed for a capacity estimate
+
+// mean/min/max over the last ANALYTICS_WINDOW samples, O(1) amortized per sample
+class RollingWindow
+{
+public:
+    RollingWindow();
+
+    void add(double v);
+    void clear();
+
+    int count() const { return n; }
+    double mean() const { return n ? sum / n : 0.0; }
+    double min() const { return n ? values[min_q[min_head % ANALYTICS_WINDOW] % ANALYTICS_WINDOW] : 0.0; }
+    double max() const { return n ? values[max_q[max_head % ANALYTICS_WINDOW] % ANALYTICS_WINDOW] : 0.0; }
+
+private:
+    double values[ANALYTICS_WINDOW];
+    unsigned long seq; // number of samples added so far
+    int n;
+    double sum;
+
+    // monotonic queues of sample numbers, front is the min (max) of the window
+    unsigned long min_q[ANALYTICS_WINDOW];
+    unsigned long max_q[ANALYTICS_WINDOW];
+    unsigned long min_head, min_tail;
+    unsigned long max_head, max_tail;
+};
+
+struct BatteryStats
+{
+    double current_mean;  // A
+    double current_min;   // A
+    double current_max;   // A
+    double current_ewma;  // A
+    double power_mean;    // W
+    double power_min;     // W
+    double power_max;     // W
+    double power_ewma;    // W
+    double ah_in;         // Ah charged since start
+    double ah_out;        // Ah discharged since start
+    double wh_in;         // Wh charged since start
+    double wh_out;        // Wh discharged since start
+    double ttg;           // s, N2kDoubleNA when not discharging
+    double capacity;      // Ah, estimated usable capacity (nominal until estimated)
+    double soh;           // %, estimated over nominal capacity
+};
+
+// incremental analytics fed with each validated reading, fixed memory per instance
+class BatteryAnalytics
+{
+public:
+    BatteryAnalytics(double nominal_capacity, unsigned char instance);
+
+    void add(const BatteryReading &r);
+
+    const BatteryStats &get_stats() const { return stats; }
+
+    // another battery (config reload): the capacity estimate starts over
+    void set_nominal_capacity(double capacity);
+
+    // relabel the metrics
+    void set_instance(unsigned char instance);
+
+private:
+    void update_capacity(const BatteryReading &r);
+    void update_metrics();
+
+    double nominal_capacity;
+    BatteryStats stats;
+    RollingWindow current;
+    RollingWindow power;
+
+    unsigned long last_time;
+    double last_current;
+    double last_power;
+    bool has_last;
+
+    // capacity estimation: SOC and net Ah at the start of the current segment
+    double anchor_soc;
+    double anchor_ah;
+    bool has_anchor;
+
+    MetricGauge m_current_ewma;
+    MetricGauge m_power_ewma;
+    MetricGauge m_ah_in;
+    MetricGauge m_ah_out;
+    MetricGauge m_wh_in;
+    MetricGauge m_wh_out;
+    MetricGauge m_ttg;
+    MetricGauge m_capacity;
+};
+
+#endif
@@ -0,0 +1,181 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BatteryBank.h"
+#include <string.h>
+
+static bool available(double v)
+{
+    return v != N2kDoubleNA;
+}
+
+BatteryBank::BatteryBank() : n_members(0), sum_voltage(0), n_voltage(0), sum_current(0), n_current(0),
+                             sum_soc_capacity(0), sum_soc_weight(0), sum_capacity(0), sum_consumed(0), n_consumed(0),
+                             n_alarm(0), n_relay(0), n_alarm_reason(0), min_ttg(-1), max_temperature(-1)
+{
+    memset(members, 0, sizeof(members));
+    memset(alarm_reason_bits, 0, sizeof(alarm_reason_bits));
+    memset(&reading, 0, sizeof(reading));
+    BatteryReading empty;
+    memset(&empty, 0, sizeof(empty));
+    update_reading(empty);
+    reading.frame = 0;
+}
+
+// add (sign 1) or remove (sign -1) the contribution of a member to the running sums
+void BatteryBank::add(const Member &m, int sign)
+{
+    n_members += sign;
+    if (available(m.voltage))
+    {
+        sum_voltage += sign * m.voltage;
+        n_voltage += sign;
+    }
+    if (available(m.current))
+    {
+        sum_current += sign * m.current;
+        n_current += sign;
+    }
+    if (available(m.capacity))
+    {
+        sum_capacity += sign * m.capacity;
+        if (available(m.soc))
+        {
+            sum_soc_capacity += sign * m.soc * m.capacity;
+            sum_soc_weight += sign * m.capacity;
+        }
+    }
+    if (available(m.consumed))
+    {
+        sum_consumed += sign * m.consumed;
+        n_consumed += sign;
+    }
+    if (m.alarm > 0)
+        n_alarm += sign;
+    if (m.relay > 0)
+        n_relay += sign;
+    if (m.alarm_reason >= 0)
+    {
+        n_alarm_reason += sign;
+        for (int b = 0; b < BANK_ALARM_BITS; b++)
+        {
+            if (m.alarm_reason & (1 << b))
+                alarm_reason_bits[b] += sign;
+        }
+    }
+}
+
+void BatteryBank::find_min_ttg()
+{
+    min_ttg = -1;
+    for (int i = 0; i < BANK_MAX_MEMBERS; i++)
+    {
+        if (members[i].active && available(members[i].ttg) && (min_ttg < 0 || members[i].ttg < members[min_ttg].ttg))
+            min_ttg = i;
+    }
+}
+
+void BatteryBank::find_max_temperature()
+{
+    max_temperature = -1;
+    for (int i = 0; i < BANK_MAX_MEMBERS; i++)
+    {
+        if (members[i].active && available(members[i].temperature) &&
+            (max_temperature < 0 || members[i].temperature > members[max_temperature].temperature))
+            max_temperature = i;
+    }
+}
+
+void BatteryBank::update(unsigned int member, const BatteryReading &r, double capacity, double ttg)
+{
+    if (member >= BANK_MAX_MEMBERS)
+        return;
+    Member &m = members[member];
+    if (m.active)
+        add(m, -1);
+    double old_ttg = m.active ? m.ttg : N2kDoubleNA;
+    double old_temperature = m.active ? m.temperature : N2kDoubleNA;
+    m.active = true;
+    m.time = r.time;
+    m.voltage = r.voltage;
+    m.current = r.current;
+    m.soc = r.soc;
+    m.capacity = capacity;
+    m.ttg = ttg;
+    m.temperature = r.temperature;
+    m.consumed = r.consumed;
+    m.alarm = r.alarm;
+    m.relay = r.relay;
+    m.alarm_reason = r.alarm_reason;
+    add(m, 1);
+
+    // the extremes only need a scan when their holder got better (or lost its value)
+    if ((int)member == min_ttg && (!available(ttg) || (available(old_ttg) && ttg > old_ttg)))
+        find_min_ttg();
+    else if (available(ttg) && (min_ttg < 0 || ttg < members[min_ttg].ttg))
+        min_ttg = member;
+    if ((int)member == max_temperature && (!available(r.temperature) || (available(old_temperature) && r.temperature < old_temperature)))
+        find_max_temperature();
+    else if (available(r.temperature) && (max_temperature < 0 || r.temperature > members[max_temperature].temperature))
+        max_temperature = member;
+
+    update_reading(r);
+}
+
+void BatteryBank::expire(unsigned long now)
+{
+    bool changed = false;
+    for (int i = 0; i < BANK_MAX_MEMBERS; i++)
+    {
+        if (members[i].active && (now - members[i].time) > BANK_MEMBER_TIMEOUT)
+        {
+            add(members[i], -1);
+            members[i].active = false;
+            changed = true;
+        }
+    }
+    if (changed)
+    {
+        find_min_ttg();
+        find_max_temperature();
+        update_reading(reading);
+    }
+}
+
+void BatteryBank::update_reading(const BatteryReading &r)
+{
+    reading.frame++;
+    reading.time = r.time;
+    reading.stamp = r.stamp;
+    reading.voltage = n_voltage ? sum_voltage / n_voltage : N2kDoubleNA; // parallel banks, same voltage
+    reading.voltage1 = N2kDoubleNA;
+    reading.current = n_current ? sum_current : N2kDoubleNA;
+    reading.soc = (sum_soc_weight > 0) ? sum_soc_capacity / sum_soc_weight : N2kDoubleNA;
+    reading.temperature = (max_temperature >= 0) ? members[max_temperature].temperature : N2kDoubleNA;
+    reading.ttg = (min_ttg >= 0) ? members[min_ttg].ttg : N2kDoubleNA;
+    reading.consumed = n_consumed ? sum_consumed : N2kDoubleNA;
+    reading.alarm = n_members ? (n_alarm > 0 ? 1 : 0) : -1;
+    reading.relay = n_members ? (n_relay > 0 ? 1 : 0) : -1;
+    reading.alarm_reason = -1;
+    if (n_alarm_reason)
+    {
+        reading.alarm_reason = 0;
+        for (int b = 0; b < BANK_ALARM_BITS; b++)
+        {
+            if (alarm_reason_bits[b])
+                reading.alarm_reason |= (1 << b);
+        }
+    }
+}
@@ -0,0 +1,92 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATTERY_BANK_H
+#define BATTERY_BANK_H
+
+#include "Battery.h"
+
+#define BANK_MAX_MEMBERS 8
+#define BANK_MEMBER_TIMEOUT 10000 // ms without frames before a member is left out of the bank
+#define BANK_ALARM_BITS 16
+
+// virtual bank made of parallel batteries, each with its own monitor:
+// summed current, capacity weighted SOC, minimum TTG, worst case temperature and alarms.
+// Each member frame updates running sums in O(1); members are only scanned when the one
+// holding the minimum TTG (or maximum temperature) gets better or leaves.
+class BatteryBank
+{
+public:
+    BatteryBank();
+
+    // fold in the latest frame of a member, capacity in Ah and ttg in s (N2kDoubleNA if unknown)
+    void update(unsigned int member, const BatteryReading &r, double capacity, double ttg);
+
+    // leave out the members that stopped reporting
+    void expire(unsigned long now);
+
+    unsigned int get_members() const { return n_members; }
+
+    // aggregated values, frame counts the bank updates
+    const BatteryReading &get_reading() const { return reading; }
+    double get_capacity() const { return n_members ? sum_capacity : N2kDoubleNA; }
+
+private:
+    struct Member
+    {
+        bool active;
+        unsigned long time;
+        double voltage;
+        double current;
+        double soc;
+        double capacity;
+        double ttg;
+        double temperature;
+        double consumed;
+        int alarm;
+        int relay;
+        int alarm_reason;
+    };
+
+    void add(const Member &m, int sign);
+    void find_min_ttg();
+    void find_max_temperature();
+    void update_reading(const BatteryReading &r);
+
+    Member members[BANK_MAX_MEMBERS];
+    unsigned int n_members;
+
+    // running sums over the active members, with the number of members contributing
+    double sum_voltage;
+    int n_voltage;
+    double sum_current;
+    int n_current;
+    double sum_soc_capacity; // SOC weighted by capacity, over the members with both
+    double sum_soc_weight;
+    double sum_capacity;
+    double sum_consumed;
+    int n_consumed;
+    int n_alarm;
+    int n_relay;
+    int alarm_reason_bits[BANK_ALARM_BITS]; // members with each alarm reason bit set
+    int n_alarm_reason;
+
+    int min_ttg; // member with the lowest TTG, -1 if none
+    int max_temperature; // member with the highest temperature, -1 if none
+
+    BatteryReading reading;
+};
+
+#endif
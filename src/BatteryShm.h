@@ -0,0 +1,125 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Client header for the live battery state published by vedirectN2K (option -s).
+It is self contained: copy it in your project, open the segment with
+battery_shm_open() and poll battery_shm_read() at any rate. Readers never
+write to the segment and never block the gateway.
+
+Each device slot is protected by a seqlock: the writer makes the sequence
+odd, updates the record and makes it even again; a reader retries when it
+sees an odd sequence or a sequence that changed while copying.
+*/
+
+#ifndef BATTERY_SHM_H
+#define BATTERY_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#ifndef ESP32_ARCH
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define BATTERY_SHM_DEFAULT_NAME "/vedirectN2K"
+#define BATTERY_SHM_MAGIC 0x4D485356 // "VSHM"
+#define BATTERY_SHM_VERSION 1
+#define BATTERY_SHM_MAX_DEVICES 8
+#define BATTERY_SHM_NA -1e9 // value not available
+#define BATTERY_SHM_READ_RETRIES 64
+
+struct BatteryShmRecord
+{
+    uint64_t frame;      // progressive number of the frame, 0 = never written
+    uint64_t time;       // ms since epoch, when the frame was validated
+    double voltage;      // V
+    double voltage1;     // V, auxiliary/starter battery
+    double current;      // A
+    double soc;          // %
+    double temperature;  // C
+    double ttg;          // s
+    double consumed;     // Ah
+    int32_t alarm;       // 1/0, -1 if not available
+    int32_t relay;       // 1/0, -1 if not available
+    int32_t alarm_reason; // -1 if not available
+    int32_t instance;    // N2K instance the device is published on
+};
+
+struct BatteryShmSlot
+{
+    std::atomic<uint32_t> seq;
+    uint32_t pad;
+    BatteryShmRecord record;
+};
+
+struct BatteryShmSegment
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_devices;
+    uint32_t record_size;
+    BatteryShmSlot slots[BATTERY_SHM_MAX_DEVICES];
+};
+
+#ifndef ESP32_ARCH
+// map the segment read-only, NULL if not available (gateway not running or wrong version)
+inline const BatteryShmSegment *battery_shm_open(const char *name = BATTERY_SHM_DEFAULT_NAME)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    void *p = mmap(NULL, sizeof(BatteryShmSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    const BatteryShmSegment *shm = (const BatteryShmSegment *)p;
+    if (shm->magic != BATTERY_SHM_MAGIC || shm->version != BATTERY_SHM_VERSION || shm->record_size != sizeof(BatteryShmRecord))
+    {
+        munmap(p, sizeof(BatteryShmSegment));
+        return NULL;
+    }
+    return shm;
+}
+
+inline void battery_shm_close(const BatteryShmSegment *shm)
+{
+    if (shm)
+        munmap((void *)shm, sizeof(BatteryShmSegment));
+}
+#endif
+
+// consistent copy of a device record, false if the slot is empty or kept changing
+inline bool battery_shm_read(const BatteryShmSegment *shm, unsigned int device, BatteryShmRecord &out)
+{
+    if (shm == NULL || device >= shm->n_devices)
+        return false;
+    const BatteryShmSlot &slot = shm->slots[device];
+    for (int i = 0; i < BATTERY_SHM_READ_RETRIES; i++)
+    {
+        uint32_t s0 = slot.seq.load(std::memory_order_acquire);
+        if (s0 & 1)
+            continue; // writer in progress
+        out = slot.record;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == s0)
+            return out.frame != 0;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BusLoad.h"
+#include <string.h>
+
+// an extended frame is 67 bits plus the data, bit stuffing adds ~10%
+static unsigned long frame_bits(unsigned char len)
+{
+    return (67 + 8 * (unsigned long)len) * 11 / 10;
+}
+
+BusLoad::BusLoad() : slot_start(0), current(0)
+{
+    memset(bits, 0, sizeof(bits));
+    memset(events, 0, sizeof(events));
+}
+
+// move to the slot of "now", clearing the ones left behind
+void BusLoad::advance(unsigned long now)
+{
+    if (now - slot_start >= (unsigned long)BUS_LOAD_SLOTS * BUS_LOAD_SLOT_MS)
+    {
+        memset(bits, 0, sizeof(bits));
+        memset(events, 0, sizeof(events));
+        slot_start = now;
+        return;
+    }
+    while (now - slot_start >= BUS_LOAD_SLOT_MS)
+    {
+        current = (current + 1) % BUS_LOAD_SLOTS;
+        bits[current] = 0;
+        events[current] = 0;
+        slot_start += BUS_LOAD_SLOT_MS;
+    }
+}
+
+void BusLoad::frame(unsigned long now, unsigned char len)
+{
+    advance(now);
+    bits[current] += frame_bits(len > 8 ? 8 : len);
+}
+
+void BusLoad::congestion(unsigned long now)
+{
+    advance(now);
+    events[current]++;
+}
+
+double BusLoad::get_load(unsigned long now)
+{
+    advance(now);
+    unsigned long total = 0;
+    for (int i = 0; i < BUS_LOAD_SLOTS; i++)
+        total += bits[i];
+    return total * 100.0 / ((double)CAN_BITRATE * BUS_LOAD_SLOTS * BUS_LOAD_SLOT_MS / 1000);
+}
+
+unsigned long BusLoad::get_congestion(unsigned long now)
+{
+    advance(now);
+    unsigned long total = 0;
+    for (int i = 0; i < BUS_LOAD_SLOTS; i++)
+        total += events[i];
+    return total;
+}
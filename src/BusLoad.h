@@ -0,0 +1,48 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BUS_LOAD_H
+#define BUS_LOAD_H
+
+#define BUS_LOAD_SLOTS 10
+#define BUS_LOAD_SLOT_MS 500 // the window covers the last 5s
+#define CAN_BITRATE 250000   // NMEA 2000
+
+// CAN bus utilisation estimated from the frames seen (received and sent) and
+// the congestion events (full interface queue, tx errors) over a sliding window
+class BusLoad
+{
+public:
+    BusLoad();
+
+    void frame(unsigned long now, unsigned char len);
+    void congestion(unsigned long now);
+
+    // percent of the bit rate used over the window
+    double get_load(unsigned long now);
+
+    // congestion events over the window
+    unsigned long get_congestion(unsigned long now);
+
+private:
+    void advance(unsigned long now);
+
+    unsigned long bits[BUS_LOAD_SLOTS];
+    unsigned long events[BUS_LOAD_SLOTS];
+    unsigned long slot_start;
+    int current;
+};
+
+#endif
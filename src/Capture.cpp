@@ -0,0 +1,146 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Capture.h"
+#include "Utils.h"
+#include "Log.h"
+#include <string.h>
+#include <errno.h>
+
+#define CAPTURE_HEADER_SIZE 16
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+}
+
+bool CaptureWriter::open(const char *path)
+{
+    f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        Log::trace("Err opening capture file {%s} {%d} {%s}\n", path, errno, strerror(errno));
+        return false;
+    }
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    memcpy(header, CAPTURE_MAGIC, 6);
+    header[6] = CAPTURE_VERSION;
+    header[7] = 0;
+    unsigned long long t = _wall_millis();
+    for (int i = 0; i < 8; i++)
+        header[8 + i] = (t >> (8 * i)) & 0xFF;
+    fwrite(header, 1, sizeof(header), f);
+    last_us = _micros();
+    Log::trace("Capturing serial data to {%s}\n", path);
+    return true;
+}
+
+void CaptureWriter::close()
+{
+    if (f)
+        fclose(f);
+    f = NULL;
+}
+
+void CaptureWriter::write_varint(unsigned long v)
+{
+    do
+    {
+        unsigned char b = v & 0x7F;
+        v >>= 7;
+        if (v)
+            b |= 0x80;
+        fputc(b, f);
+    } while (v);
+}
+
+void CaptureWriter::write(const unsigned char *data, int len, unsigned long t_us)
+{
+    if (f == NULL || len <= 0)
+        return;
+    write_varint(t_us - last_us);
+    write_varint(len);
+    fwrite(data, 1, len, f);
+    fflush(f); // serial rates are low, keep the capture usable if the process is killed
+    last_us = t_us;
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+bool CaptureReader::open(const char *path)
+{
+    f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        Log::trace("Err opening capture file {%s} {%d} {%s}\n", path, errno, strerror(errno));
+        return false;
+    }
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, CAPTURE_MAGIC, 6) != 0 || header[6] != CAPTURE_VERSION)
+    {
+        Log::trace("Invalid capture file {%s}\n", path);
+        close();
+        return false;
+    }
+    start_time = 0;
+    for (int i = 0; i < 8; i++)
+        start_time |= ((unsigned long long)header[8 + i]) << (8 * i);
+    return true;
+}
+
+void CaptureReader::close()
+{
+    if (f)
+        fclose(f);
+    f = NULL;
+}
+
+void CaptureReader::rewind()
+{
+    if (f)
+        fseek(f, CAPTURE_HEADER_SIZE, SEEK_SET);
+}
+
+bool CaptureReader::read_varint(unsigned long &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = fgetc(f);
+        if (c == EOF)
+            return false;
+        v |= ((unsigned long)(c & 0x7F)) << shift;
+        if ((c & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+int CaptureReader::next(unsigned char *buffer, int size, unsigned long &delta_us)
+{
+    if (f == NULL)
+        return -1;
+    unsigned long len;
+    if (!read_varint(delta_us))
+        return feof(f) ? 0 : -1;
+    if (!read_varint(len) || len > (unsigned long)size)
+        return -1;
+    if (fread(buffer, 1, len, f) != len)
+        return -1;
+    return len;
+}
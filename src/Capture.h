@@ -0,0 +1,77 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+
+/*
+Raw serial capture format:
+  header: "VEDCAP" <version:1 byte> <reserved:1 byte> <start time, ms since epoch: 8 bytes LE>
+  records: <us since the previous record: varint> <length: varint> <bytes>
+one record per read from the port, varints are LEB128.
+*/
+
+#define CAPTURE_MAGIC "VEDCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_MAX_CHUNK 4096
+
+class CaptureWriter
+{
+public:
+    CaptureWriter() : f(NULL), last_us(0) {}
+    ~CaptureWriter();
+
+    bool open(const char *path);
+    void close();
+
+    // append a chunk read at "t_us" (monotonic microseconds)
+    void write(const unsigned char *data, int len, unsigned long t_us);
+
+    bool is_open() const { return f != NULL; }
+
+private:
+    void write_varint(unsigned long v);
+
+    FILE *f;
+    unsigned long last_us;
+};
+
+class CaptureReader
+{
+public:
+    CaptureReader() : f(NULL), start_time(0) {}
+    ~CaptureReader();
+
+    bool open(const char *path);
+    void close();
+
+    // next chunk: returns its length, 0 at the end of the capture, -1 if corrupted
+    int next(unsigned char *buffer, int size, unsigned long &delta_us);
+
+    // go back to the first record
+    void rewind();
+
+    unsigned long long get_start_time() const { return start_time; }
+
+private:
+    bool read_varint(unsigned long &v);
+
+    FILE *f;
+    unsigned long long start_time;
+};
+
+#endif
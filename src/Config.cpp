@@ -0,0 +1,148 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Config.h"
+#include "Log.h"
+#include <stdio.h>
+#include <string.h>
+
+static void copy_name(char *dst, const char *src)
+{
+    snprintf(dst, CONFIG_NAME_SIZE, "%s", src);
+}
+
+Config::Config() : n_devices(0), source(CONFIG_SOURCE), speed(CONFIG_SPEED), bank_instance(-1)
+{
+    can_device[0] = 0;
+    for (unsigned int i = 0; i < CONFIG_MAX_DEVICES; i++)
+    {
+        devices[i].port[0] = 0;
+        devices[i].capacity = CONFIG_CAPACITY;
+        devices[i].instance = CONFIG_INSTANCE + 2 * i;
+        devices[i].instance_e = CONFIG_INSTANCE_E + 2 * i;
+    }
+}
+
+void Config::set_can_device(const char *name)
+{
+    copy_name(can_device, name);
+}
+
+bool Config::set_port(unsigned int n, const char *port)
+{
+    if (n >= CONFIG_MAX_DEVICES || n > n_devices)
+        return false;
+    copy_name(devices[n].port, port);
+    if (n == n_devices)
+        n_devices++;
+    return true;
+}
+
+bool Config::parse_line(char *line)
+{
+    char key[16];
+    char value[CONFIG_NAME_SIZE];
+    int n;
+    if (sscanf(line, "%15s %127s%n", key, value, &n) != 2)
+        return false;
+    const char *rest = line + n;
+    if (strcmp(key, "can") == 0)
+    {
+        set_can_device(value);
+        return true;
+    }
+    if (strcmp(key, "device") == 0)
+    {
+        if (!set_port(n_devices, value))
+            return false;
+        ConfigDevice &d = devices[n_devices - 1];
+        unsigned int instance = d.instance, instance_e = d.instance_e;
+        int fields = sscanf(rest, "%lf %u %u", &d.capacity, &instance, &instance_e);
+        if (fields == 0)
+            return false;
+        if (fields == 2)
+            instance_e = instance + 1;
+        d.instance = instance;
+        d.instance_e = instance_e;
+        return d.capacity > 0 && instance < 253 && instance_e < 253;
+    }
+    int v;
+    if (sscanf(value, "%d", &v) != 1)
+        return false;
+    if (strcmp(key, "source") == 0 && v >= 0 && v < 253)
+        source = v;
+    else if (strcmp(key, "speed") == 0 && v > 0)
+        speed = v;
+    else if (strcmp(key, "bank") == 0 && v >= -1 && v < 253)
+        bank_instance = v;
+    else
+        return false;
+    return true;
+}
+
+bool Config::load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        Log::trace("Err opening config {%s}\n", path);
+        return false;
+    }
+    char line[CONFIG_LINE_SIZE];
+    int line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+        char dummy[2];
+        if (sscanf(line, " %1s", dummy) != 1)
+            continue; // blank line
+        if (!parse_line(line))
+        {
+            Log::trace("Err config {%s} line {%d}\n", path, line_no);
+            ok = false;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+void Config::keep_startup(const Config &running)
+{
+    if (strcmp(can_device, running.can_device) != 0 || source != running.source || speed != running.speed)
+        Log::trace("Config CAN device, N2K address or speed changed, restart to apply\n");
+    if ((bank_instance >= 0) != (running.bank_instance >= 0))
+    {
+        Log::trace("Config bank turned %s, restart to apply\n", bank_instance >= 0 ? "on" : "off");
+        bank_instance = running.bank_instance;
+    }
+    if (n_devices != running.n_devices)
+        Log::trace("Config has {%u} devices instead of {%u}, restart to apply\n", n_devices, running.n_devices);
+    for (unsigned int i = 0; i < running.n_devices; i++)
+    {
+        if (i < n_devices && strcmp(devices[i].port, running.devices[i].port) != 0)
+            Log::trace("Config device {%u} port {%s} changed, restart to apply\n", i, devices[i].port);
+        if (i >= n_devices)
+            devices[i] = running.devices[i];
+        copy_name(devices[i].port, running.devices[i].port);
+    }
+    n_devices = running.n_devices;
+    copy_name(can_device, running.can_device);
+    source = running.source;
+    speed = running.speed;
+}
@@ -0,0 +1,75 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define CONFIG_MAX_DEVICES 4
+#define CONFIG_NAME_SIZE 128
+#define CONFIG_LINE_SIZE 256
+
+// defaults, monitor n gets instances CONFIG_INSTANCE + 2n and CONFIG_INSTANCE_E + 2n
+#define CONFIG_CAPACITY 280.0 // Ah
+#define CONFIG_INSTANCE 0
+#define CONFIG_INSTANCE_E 1
+#define CONFIG_SOURCE 23
+#define CONFIG_SPEED 19200
+
+struct ConfigDevice
+{
+    char port[CONFIG_NAME_SIZE]; // see VEDirectPort::create
+    double capacity;             // Ah, nominal
+    unsigned char instance;      // N2K instance of the battery
+    unsigned char instance_e;    // N2K instance of the auxiliary voltage
+};
+
+// the settings, from the defaults, the config file and the command line.
+// Built once and then only read: a reload builds a new object and swaps it in.
+//
+// config file, one setting per line, '#' starts a comment:
+//   can <device>
+//   source <N2K address>
+//   speed <baud rate>
+//   bank <instance>
+//   device <port> [<capacity Ah> [<instance> [<auxiliary instance>]]]
+class Config
+{
+public:
+    Config();
+
+    // read a config file over the defaults, false (and logged) on any error
+    bool load(const char *path);
+
+    // monitor n on a port, with the defaults for its position if it is a new one
+    bool set_port(unsigned int n, const char *port);
+
+    // take over from the running config what cannot change without a restart
+    // (ports, CAN device, N2K address, speed, bank on/off), logging the differences
+    void keep_startup(const Config &running);
+
+    void set_can_device(const char *name);
+
+    unsigned int n_devices;
+    ConfigDevice devices[CONFIG_MAX_DEVICES];
+    char can_device[CONFIG_NAME_SIZE];
+    unsigned char source; // N2K address claimed first
+    unsigned int speed;   // ve.direct baud rate
+    int bank_instance;    // -1 = no bank
+
+private:
+    bool parse_line(char *line);
+};
+
+#endif
@@ -0,0 +1,264 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESP32_ARCH
+
+#include "Discovery.h"
+#include "Ports.h"
+#include "Scheduler.h"
+#include "Utils.h"
+#include "Log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+
+#define DISCOVERY_MAP_SIZE 32
+
+struct MapEntry
+{
+    char key[DISCOVERY_KEY_SIZE];
+    int position;
+};
+
+static int is_usb_tty(const struct dirent *e)
+{
+    return strncmp(e->d_name, "ttyUSB", 6) == 0;
+}
+
+static int is_entry(const struct dirent *e)
+{
+    return e->d_name[0] != '.';
+}
+
+// the key a device is known by in the map
+static const char *port_key(const DiscoveredPort &p)
+{
+    return p.serial[0] ? p.serial : p.path;
+}
+
+Discovery::Discovery() : n_ports(0)
+{
+}
+
+bool Discovery::add_candidate(const char *path)
+{
+    char device[PATH_MAX];
+    if (n_ports == DISCOVERY_MAX_PORTS || realpath(path, device) == NULL || strlen(device) >= CONFIG_NAME_SIZE)
+        return false;
+    for (int i = 0; i < n_ports; i++)
+        if (strcmp(ports[i].device, device) == 0)
+            return false; // a ttyUSB already found through its by-id link
+    DiscoveredPort &p = ports[n_ports++];
+    snprintf(p.path, sizeof(p.path), "%s", path);
+    strcpy(p.device, device);
+    p.pid[0] = 0;
+    p.serial[0] = 0;
+    p.identified = false;
+    p.position = -1;
+    return true;
+}
+
+int Discovery::scan(const char *by_id_dir, const char *dev_dir)
+{
+    const char *dirs[] = {by_id_dir, dev_dir};
+    int (*filters[])(const struct dirent *) = {is_entry, is_usb_tty};
+    for (int d = 0; d < 2; d++)
+    {
+        struct dirent **list;
+        int n = scandir(dirs[d], &list, filters[d], alphasort);
+        if (n < 0)
+            continue; // no by-id directory without USB serial adapters
+        for (int i = 0; i < n; i++)
+        {
+            char path[CONFIG_NAME_SIZE];
+            if (snprintf(path, sizeof(path), "%s/%s", dirs[d], list[i]->d_name) < (int)sizeof(path))
+                add_candidate(path);
+            free(list[i]);
+        }
+        free(list);
+    }
+    Log::trace("Discovery {%d} candidate ports\n", n_ports);
+    return n_ports;
+}
+
+int Discovery::on_line(const char *line, void *ctx)
+{
+    DiscoveredPort *p = (DiscoveredPort *)ctx;
+    if (strncmp(line, "PID\t", 4) == 0)
+    {
+        snprintf(p->pid, sizeof(p->pid), "%s", line + 4);
+        return 0;
+    }
+    if (strncmp(line, "SER#\t", 5) == 0)
+    {
+        snprintf(p->serial, sizeof(p->serial), "%s", line + 5);
+        return 0;
+    }
+    if (strstr(line, "Checksum"))
+    {
+        // a history block carries neither, wait for the live one
+        if (p->pid[0] || p->serial[0])
+            p->identified = true;
+        return -1;
+    }
+    return 0;
+}
+
+int Discovery::identify(unsigned int speed, unsigned long timeout)
+{
+    // all the ports are opened and read together, non-blocking
+    Scheduler scheduler;
+    scheduler.start(_millis());
+    VEDirectPort *probes[DISCOVERY_MAX_PORTS];
+    for (int i = 0; i < n_ports; i++)
+    {
+        probes[i] = VEDirectPort::create(ports[i].path, speed);
+        probes[i]->set_handler(on_line, &ports[i]);
+        probes[i]->attach(scheduler);
+    }
+    unsigned long start = _millis();
+    int identified = 0;
+    while (identified < n_ports && _millis() - start < timeout)
+    {
+        scheduler.run(_millis());
+        int fds[DISCOVERY_MAX_PORTS];
+        int n_fds = 0;
+        identified = 0;
+        for (int i = 0; i < n_ports; i++)
+        {
+            if (!ports[i].identified)
+            {
+                probes[i]->listen(0);
+                fds[n_fds++] = probes[i]->get_fd();
+            }
+            if (ports[i].identified)
+                identified++;
+        }
+        long left = (long)timeout - (long)(_millis() - start);
+        if (identified < n_ports && left > 0)
+            wait_readable(fds, n_fds, scheduler.next_timeout(_millis(), left));
+    }
+    for (int i = 0; i < n_ports; i++)
+    {
+        probes[i]->close();
+        delete probes[i];
+        if (ports[i].identified)
+            Log::trace("Discovered {%s} PID {%s} serial {%s}\n", ports[i].path, ports[i].pid, ports[i].serial);
+        else
+            Log::trace("No ve.direct frame from {%s}\n", ports[i].path);
+    }
+    Log::trace("Discovery identified {%d} of {%d} ports in {%lu ms}\n", identified, n_ports, _millis() - start);
+    return identified;
+}
+
+static int load_map(const char *path, MapEntry *map)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    char line[CONFIG_LINE_SIZE];
+    int n = 0;
+    while (n < DISCOVERY_MAP_SIZE && fgets(line, sizeof(line), f))
+    {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+        if (sscanf(line, "%63s %d", map[n].key, &map[n].position) == 2 && map[n].position >= 0)
+            n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static void save_map(const char *path, const MapEntry *map, int n)
+{
+    // replaced in one go, a crash leaves the old map or the new one
+    char tmp[CONFIG_NAME_SIZE + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        Log::trace("Err saving device map {%s} {%d} {%s}\n", tmp, errno, strerror(errno));
+        return;
+    }
+    fprintf(f, "# ve.direct serial number (or adapter path) and device position, instances 2n and 2n+1 by default\n");
+    for (int i = 0; i < n; i++)
+        fprintf(f, "%s %d\n", map[i].key, map[i].position);
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+        Log::trace("Err saving device map {%s} {%d} {%s}\n", path, errno, strerror(errno));
+}
+
+int Discovery::bind(Config &config, const char *map_file)
+{
+    MapEntry map[DISCOVERY_MAP_SIZE];
+    int n_map = load_map(map_file, map);
+    bool taken[CONFIG_MAX_DEVICES] = {false};
+    for (int m = 0; m < n_map; m++)
+        if (map[m].position < CONFIG_MAX_DEVICES)
+            taken[map[m].position] = true;
+
+    bool changed = false;
+    for (int i = 0; i < n_ports; i++)
+    {
+        DiscoveredPort &p = ports[i];
+        if (!p.identified)
+            continue;
+        for (int m = 0; m < n_map && p.position < 0; m++)
+            if (strcmp(map[m].key, port_key(p)) == 0)
+                p.position = map[m].position;
+        if (p.position >= 0)
+            continue;
+        // a new device: the first position no known device holds
+        for (int k = 0; k < CONFIG_MAX_DEVICES && p.position < 0; k++)
+            if (!taken[k])
+                p.position = k;
+        if (p.position < 0 || n_map == DISCOVERY_MAP_SIZE)
+        {
+            Log::trace("Err no free position for {%s} {%s}, see {%s}\n", p.path, port_key(p), map_file);
+            p.position = -1;
+            continue;
+        }
+        taken[p.position] = true;
+        snprintf(map[n_map].key, sizeof(map[n_map].key), "%s", port_key(p));
+        map[n_map].position = p.position;
+        n_map++;
+        changed = true;
+    }
+    if (changed)
+        save_map(map_file, map, n_map);
+
+    // the devices in position order, each with the capacity and instances of its position
+    ConfigDevice positions[CONFIG_MAX_DEVICES];
+    memcpy(positions, config.devices, sizeof(positions));
+    config.n_devices = 0;
+    for (int k = 0; k < CONFIG_MAX_DEVICES; k++)
+    {
+        for (int i = 0; i < n_ports; i++)
+        {
+            if (ports[i].position != k)
+                continue;
+            config.devices[config.n_devices] = positions[k];
+            snprintf(config.devices[config.n_devices].port, CONFIG_NAME_SIZE, "%s", ports[i].path);
+            config.n_devices++;
+            break;
+        }
+    }
+    return config.n_devices;
+}
+
+#endif
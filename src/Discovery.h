@@ -0,0 +1,70 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#ifndef ESP32_ARCH
+
+#include "Config.h"
+
+#define DISCOVERY_BY_ID_DIR "/dev/serial/by-id"
+#define DISCOVERY_DEV_DIR "/dev"
+#define DISCOVERY_MAP_FILE "/var/lib/vedirectN2K/devices.map"
+#define DISCOVERY_MAX_PORTS 16
+#define DISCOVERY_TIMEOUT 2500 // ms, a frame every second and the first one is likely cut
+#define DISCOVERY_KEY_SIZE 64
+
+struct DiscoveredPort
+{
+    char path[CONFIG_NAME_SIZE];
+    char device[CONFIG_NAME_SIZE]; // the link resolved, to skip duplicates
+    char pid[16];
+    char serial[DISCOVERY_KEY_SIZE];
+    bool identified; // a valid frame was received
+    int position;    // in the serial number map, -1 if not bound
+};
+
+// the "auto" port: find the ve.direct devices on the USB serial ports, tell
+// them apart by their serial number (SER#, or the by-id path of the adapter
+// when missing) and keep each one on the same device position, thus instances,
+// across reboots through a map file of "<serial> <position>" lines
+class Discovery
+{
+public:
+    Discovery();
+
+    // the candidates: the by-id links, then the ttyUSB devices not linked
+    int scan(const char *by_id_dir = DISCOVERY_BY_ID_DIR, const char *dev_dir = DISCOVERY_DEV_DIR);
+
+    // open all the candidates at once and wait for a valid frame from each,
+    // returns the number identified
+    int identify(unsigned int speed, unsigned long timeout = DISCOVERY_TIMEOUT);
+
+    // assign the positions from the map file (new devices get the first free
+    // ones and are saved) and set the ports of the config, returns the devices bound
+    int bind(Config &config, const char *map_file);
+
+private:
+    bool add_candidate(const char *path);
+    static int on_line(const char *line, void *ctx);
+
+    DiscoveredPort ports[DISCOVERY_MAX_PORTS];
+    int n_ports;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "HistoryMetrics.h"
+#include <stdio.h>
+
+struct HistoryField
+{
+    const char *name;
+    const char *help;
+    double scale; // from the ve.direct unit
+};
+
+static const HistoryField HISTORY_FIELDS[VE_HISTORY_FIELDS] = {
+    {"battery_history_deepest_discharge_ah", "Depth of the deepest discharge", 0.001},
+    {"battery_history_last_discharge_ah", "Depth of the last discharge", 0.001},
+    {"battery_history_average_discharge_ah", "Depth of the average discharge", 0.001},
+    {"battery_history_charge_cycles", "Number of charge cycles", 1},
+    {"battery_history_full_discharges", "Number of full discharges", 1},
+    {"battery_history_drawn_ah", "Cumulative Ah drawn", 0.001},
+    {"battery_history_min_voltage_volts", "Minimum main voltage", 0.001},
+    {"battery_history_max_voltage_volts", "Maximum main voltage", 0.001},
+    {"battery_history_since_full_charge_seconds", "Time since the last full charge", 1},
+    {"battery_history_automatic_syncs", "Number of automatic synchronizations", 1},
+    {"battery_history_low_voltage_alarms", "Number of low main voltage alarms", 1},
+    {"battery_history_high_voltage_alarms", "Number of high main voltage alarms", 1},
+    {"battery_history_low_aux_voltage_alarms", "Number of low auxiliary voltage alarms", 1},
+    {"battery_history_high_aux_voltage_alarms", "Number of high auxiliary voltage alarms", 1},
+    {"battery_history_min_aux_voltage_volts", "Minimum auxiliary voltage", 0.001},
+    {"battery_history_max_aux_voltage_volts", "Maximum auxiliary voltage", 0.001},
+    {"battery_history_discharged_kwh", "Amount of discharged energy", 0.01},
+    {"battery_history_charged_kwh", "Amount of charged energy", 0.01}};
+
+HistoryMetrics::HistoryMetrics(unsigned char instance) : version(0)
+{
+    char labels[METRIC_LABELS_SIZE];
+    snprintf(labels, sizeof(labels), "instance=\"%d\"", instance);
+    // reserved once at startup, metrics are never unregistered
+    for (int i = 0; i < VE_HISTORY_FIELDS; i++)
+        gauges[i] = new MetricGauge(HISTORY_FIELDS[i].name, HISTORY_FIELDS[i].help, labels);
+}
+
+void HistoryMetrics::set_instance(unsigned char instance)
+{
+    char labels[METRIC_LABELS_SIZE];
+    snprintf(labels, sizeof(labels), "instance=\"%d\"", instance);
+    for (int i = 0; i < VE_HISTORY_FIELDS; i++)
+        gauges[i]->set_labels(labels);
+}
+
+void HistoryMetrics::update(VEDirectHistory &history)
+{
+    if (history.get_version() == version)
+        return;
+    version = history.get_version();
+    for (int i = 0; i < VE_HISTORY_FIELDS; i++)
+    {
+        int v;
+        if (history.get_value(v, i + 1))
+            gauges[i]->set(v * HISTORY_FIELDS[i].scale);
+    }
+}
@@ -0,0 +1,38 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HISTORY_METRICS_H
+#define HISTORY_METRICS_H
+
+#include "VeDirect.h"
+#include "Metrics.h"
+
+// the BMV history block (H1..H18) as gauges, updated only when a block changed something
+class HistoryMetrics
+{
+public:
+    HistoryMetrics(unsigned char instance);
+
+    void update(VEDirectHistory &history);
+
+    // relabel the gauges (config reload)
+    void set_instance(unsigned char instance);
+
+private:
+    MetricGauge *gauges[VE_HISTORY_FIELDS];
+    unsigned long version;
+};
+
+#endif
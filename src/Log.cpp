@@ -15,9 +15,12 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 
 #ifdef ESP32_ARCH
 #include <Arduino.h>
+#else
+#include <pthread.h>
 #endif
 
 #include "Log.h"
+#include "Trace.h"
 #include <stdio.h>
 #include <time.h>
 #include <stdarg.h>
@@ -28,13 +31,23 @@ static bool _debug = false;
 
 static char outbfr[MAX_TRACE_SIZE];
 
+#ifndef ESP32_ARCH
+// the reader and the N2K thread may trace at the same time
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOG_LOCK() pthread_mutex_lock(&log_mutex)
+#define LOG_UNLOCK() pthread_mutex_unlock(&log_mutex)
+#else
+#define LOG_LOCK()
+#define LOG_UNLOCK()
+#endif
+
 const char* _gettime() {
 	static char _buffer[80];
 	time_t rawtime;
-	struct tm * timeinfo;
+	struct tm timeinfo;
 	time (&rawtime);
-	timeinfo = localtime (&rawtime);
-	strftime (_buffer, 80, "%T", timeinfo);
+	localtime_r (&rawtime, &timeinfo); // localtime() reloads the zone (and allocates) on every call
+	strftime (_buffer, 80, "%T", &timeinfo);
 	return _buffer;
 }
 
@@ -45,13 +58,19 @@ void _trace(const char* text) {
 
     #else
 	printf("%s", text);
-	FILE* f = fopen("/var/log/ve.direct.log", "a+");
-	if (f==NULL) {
-		f = fopen("./ve.direct.log", "a+");
+	// opened once and kept, the steady state must not allocate
+	static FILE* f = NULL;
+	static bool opened = false;
+	if (!opened) {
+		opened = true;
+		f = fopen("/var/log/ve.direct.log", "a+");
+		if (f==NULL) {
+			f = fopen("./ve.direct.log", "a+");
+		}
 	}
 	if (f) {
 		fprintf(f, "%s %s", _gettime(), text);
-		fclose(f);
+		fflush(f);
 	}
     #endif
 }
@@ -69,18 +88,23 @@ void Log::setdebug() {
 
 void Log::debug(const char* text, ...) {
 	if (_debug) {
+		LOG_LOCK();
 		va_list args;
 		va_start(args, text);
 		vsnprintf(outbfr, MAX_TRACE_SIZE, text, args);
 		va_end(args);
 		_trace(outbfr);
+		LOG_UNLOCK();
 	}
 }
 
 void Log::trace(const char* text, ...) {
+	TRACE_SCOPE("log");
+	LOG_LOCK();
 	va_list args;
 	va_start(args, text);
 	vsnprintf(outbfr, MAX_TRACE_SIZE, text, args);
 	va_end(args);
 	_trace(outbfr);
+	LOG_UNLOCK();
 }
@@ -0,0 +1,234 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Mapping.h"
+#include "Log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAPPING_LINE_SIZE 256
+#define MAPPING_MAX_ENTRIES (PLAN_MAX_MESSAGES * PLAN_MAX_PARAMS)
+
+static const MappingEntry DEFAULT_MAPPING[] = {
+    {127508, MAPPING_MAIN, "voltage", "V", 0.001},
+    {127508, MAPPING_MAIN, "current", "I", 0.001},
+    {127508, MAPPING_MAIN, "temperature", "T", 1},
+    {127506, MAPPING_MAIN, "soc", "SOC", 0.1},
+    {127506, MAPPING_MAIN, "capacity", "capacity", 1},
+    {127506, MAPPING_MAIN, "ttg", "ttg", 1},
+    {127506, MAPPING_MAIN, "soh", "soh", 1},
+    {127508, MAPPING_AUX, "voltage", "VS", 0.001},
+    {127508, MAPPING_AUX, "current", "0", 1},
+};
+
+// parameters of the supported PGNs, in the order of the N2K send functions
+static const char *PARAMS_127508[PLAN_MAX_PARAMS] = {"voltage", "current", "temperature", NULL};
+static const char *PARAMS_127506[PLAN_MAX_PARAMS] = {"soc", "soh", "ttg", "capacity"};
+
+static const char **pgn_params(unsigned long pgn)
+{
+    switch (pgn)
+    {
+    case 127508:
+        return PARAMS_127508;
+    case 127506:
+        return PARAMS_127506;
+    default:
+        return NULL;
+    }
+}
+
+MappingPlan::MappingPlan() : n_messages(0), n_constants(0)
+{
+}
+
+int MappingPlan::add_constant(double v)
+{
+    for (int i = 0; i < n_constants; i++)
+    {
+        if (constants[i] == v)
+            return SLOT_CONSTANTS + i;
+    }
+    if (n_constants == PLAN_MAX_CONSTANTS)
+        return -1;
+    constants[n_constants] = v;
+    return SLOT_CONSTANTS + n_constants++;
+}
+
+bool MappingPlan::compile(const MappingEntry *entries, int n)
+{
+    n_messages = 0;
+    n_constants = 0;
+    for (int i = 0; i < n; i++)
+    {
+        const MappingEntry &e = entries[i];
+        const char **params = pgn_params(e.pgn);
+        if (params == NULL)
+        {
+            Log::trace("Err mapping: unsupported PGN {%lu}\n", e.pgn);
+            return false;
+        }
+        int param = -1;
+        for (int k = 0; k < PLAN_MAX_PARAMS; k++)
+        {
+            if (params[k] && strcmp(params[k], e.parameter) == 0)
+                param = k;
+        }
+        if (param < 0)
+        {
+            Log::trace("Err mapping: PGN {%lu} has no parameter {%s}\n", e.pgn, e.parameter);
+            return false;
+        }
+
+        int slot = -1;
+        for (unsigned int f = 0; f < BMV_N_FIELDS; f++)
+        {
+            if (strcmp(BMV_FIELDS[f].veName, e.source) == 0 && BMV_FIELDS[f].veType != VE_STRING)
+                slot = BMV_FIELDS[f].veIndex;
+        }
+        if (strcmp(e.source, "ttg") == 0)
+            slot = SLOT_TTG;
+        else if (strcmp(e.source, "capacity") == 0)
+            slot = SLOT_CAPACITY;
+        else if (strcmp(e.source, "soh") == 0)
+            slot = SLOT_SOH;
+        else if (slot < 0)
+        {
+            char *end;
+            double v = strtod(e.source, &end);
+            if (end != e.source && *end == 0)
+                slot = add_constant(v);
+        }
+        if (slot < 0)
+        {
+            Log::trace("Err mapping: unknown source {%s}\n", e.source);
+            return false;
+        }
+
+        // one message per PGN and instance, in the order they first appear
+        int m = 0;
+        while (m < n_messages && !(messages[m].pgn == e.pgn && messages[m].instance == e.instance))
+            m++;
+        if (m == n_messages)
+        {
+            if (n_messages == PLAN_MAX_MESSAGES)
+            {
+                Log::trace("Err mapping: more than {%d} messages\n", PLAN_MAX_MESSAGES);
+                return false;
+            }
+            PlanMessage &msg = messages[n_messages++];
+            msg.pgn = e.pgn;
+            msg.instance = e.instance;
+            for (int k = 0; k < PLAN_MAX_PARAMS; k++)
+            {
+                msg.slot[k] = SLOT_NA;
+                msg.scale[k] = 1;
+            }
+        }
+        messages[m].slot[param] = slot;
+        messages[m].scale[param] = e.scale;
+    }
+    Log::trace("Mapping compiled {%d} messages\n", n_messages);
+    return true;
+}
+
+bool MappingPlan::compile_default()
+{
+    return compile(DEFAULT_MAPPING, sizeof(DEFAULT_MAPPING) / sizeof(MappingEntry));
+}
+
+bool MappingPlan::load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        Log::trace("Err opening mapping {%s}\n", path);
+        return false;
+    }
+    static MappingEntry entries[MAPPING_MAX_ENTRIES];
+    static char names[MAPPING_MAX_ENTRIES][2][32];
+    char line[MAPPING_LINE_SIZE];
+    int n = 0;
+    int line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+        unsigned long pgn;
+        char instance[8];
+        double scale;
+        char dummy[2];
+        if (sscanf(line, " %1s", dummy) != 1)
+            continue; // blank line
+        if (n == MAPPING_MAX_ENTRIES ||
+            sscanf(line, "%lu %7s %31s %31s %lf", &pgn, instance, names[n][0], names[n][1], &scale) != 5)
+        {
+            Log::trace("Err mapping {%s} line {%d}\n", path, line_no);
+            ok = false;
+            break;
+        }
+        if (strcmp(instance, "main") == 0 || strcmp(instance, "0") == 0)
+            entries[n].instance = MAPPING_MAIN;
+        else if (strcmp(instance, "aux") == 0 || strcmp(instance, "1") == 0)
+            entries[n].instance = MAPPING_AUX;
+        else
+        {
+            Log::trace("Err mapping {%s} line {%d}: instance {%s} is not main or aux\n", path, line_no, instance);
+            ok = false;
+            break;
+        }
+        entries[n].pgn = pgn;
+        entries[n].parameter = names[n][0];
+        entries[n].source = names[n][1];
+        entries[n].scale = scale;
+        n++;
+    }
+    fclose(f);
+    return ok && compile(entries, n);
+}
+
+void MappingPlan::publish(N2K &n2k, unsigned char sid, const BatteryReading &r, const BatteryStats &stats, double ttg,
+                          unsigned char instance, unsigned char instance_e) const
+{
+    double values[PLAN_N_SLOTS];
+    for (unsigned int i = 0; i < BMV_N_FIELDS; i++)
+        values[i] = (r.raw_valid & (1 << i)) ? r.raw[i] : NAN;
+    values[SLOT_TTG] = (ttg == N2kDoubleNA) ? NAN : ttg;
+    values[SLOT_CAPACITY] = (stats.capacity == N2kDoubleNA) ? NAN : stats.capacity;
+    values[SLOT_SOH] = (stats.soh == N2kDoubleNA) ? NAN : stats.soh;
+    values[SLOT_NA] = NAN;
+    memcpy(values + SLOT_CONSTANTS, constants, n_constants * sizeof(double));
+
+    for (int m = 0; m < n_messages; m++)
+    {
+        const PlanMessage &msg = messages[m];
+        double v[PLAN_MAX_PARAMS];
+        for (int k = 0; k < PLAN_MAX_PARAMS; k++)
+        {
+            v[k] = values[msg.slot[k]] * msg.scale[k];
+            v[k] = isnan(v[k]) ? N2kDoubleNA : v[k];
+        }
+        unsigned char i = (msg.instance == MAPPING_AUX) ? instance_e : instance;
+        if (msg.pgn == 127508)
+            n2k.sendBattery(sid, v[0], v[1], v[2], i);
+        else
+            n2k.sendBatteryStatus(sid, v[0], v[3], v[2], i, v[1]);
+    }
+}
@@ -0,0 +1,93 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include "VeDirect.h"
+#include "Battery.h"
+#include "BatteryAnalytics.h"
+#include "N2K.h"
+
+// declarative ve.direct to N2K mapping, compiled at startup into a flat plan:
+// per message the PGN, the instance (main or auxiliary of the device) and, for
+// each PGN parameter, the slot of the value vector to read and the scale to apply.
+//
+// mapping file, one parameter per line, '#' starts a comment:
+//   <pgn> <main|aux> <parameter> <source> <scale>
+// (0 and 1 are still read as main and aux)
+// parameters: 127508 voltage current temperature, 127506 soc soh ttg capacity
+// sources: a ve.direct field (V, VS, I, SOC, T, ...), the derived ttg (s),
+// capacity (Ah) or soh (%), or a number used as a constant
+
+#define PLAN_MAX_MESSAGES 8
+#define PLAN_MAX_PARAMS 4
+#define PLAN_MAX_CONSTANTS 8
+
+// the instance a message goes out on
+#define MAPPING_MAIN 0 // the device instance
+#define MAPPING_AUX 1  // the auxiliary instance (config instance_e)
+
+// value vector: the raw ve.direct fields, then the derived values, then the constants
+#define SLOT_TTG (BMV_N_FIELDS)
+#define SLOT_CAPACITY (BMV_N_FIELDS + 1)
+#define SLOT_SOH (BMV_N_FIELDS + 2)
+#define SLOT_NA (BMV_N_FIELDS + 3)
+#define SLOT_CONSTANTS (BMV_N_FIELDS + 4)
+#define PLAN_N_SLOTS (SLOT_CONSTANTS + PLAN_MAX_CONSTANTS)
+
+struct MappingEntry
+{
+    unsigned long pgn;
+    unsigned char instance; // MAPPING_MAIN or MAPPING_AUX
+    const char *parameter;
+    const char *source;
+    double scale;
+};
+
+struct PlanMessage
+{
+    unsigned long pgn;
+    unsigned char instance; // MAPPING_MAIN or MAPPING_AUX
+    unsigned short slot[PLAN_MAX_PARAMS]; // in the order of the PGN parameters
+    double scale[PLAN_MAX_PARAMS];
+};
+
+class MappingPlan
+{
+public:
+    MappingPlan();
+
+    // the built-in mapping (the one of a BMV-712 with the starter battery on VS)
+    bool compile_default();
+    bool compile(const MappingEntry *entries, int n);
+    bool load(const char *path);
+
+    // send the messages of the plan for a device with these main and auxiliary instances
+    void publish(N2K &n2k, unsigned char sid, const BatteryReading &r, const BatteryStats &stats, double ttg,
+                 unsigned char instance, unsigned char instance_e) const;
+
+    int get_messages() const { return n_messages; }
+
+private:
+    int add_constant(double v);
+
+    PlanMessage messages[PLAN_MAX_MESSAGES];
+    int n_messages;
+    double constants[PLAN_MAX_CONSTANTS];
+    int n_constants;
+};
+
+#endif
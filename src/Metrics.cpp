@@ -0,0 +1,304 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Metrics.h"
+#include "Log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifndef ESP32_ARCH
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#define METRICS_BUFFER_SIZE 32768
+
+Metric *Metric::head = NULL;
+
+// snprintf that never runs past the buffer, returns what was actually written
+static int append(char *buffer, size_t size, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static int append(char *buffer, size_t size, const char *format, ...)
+{
+    if (size == 0)
+        return 0;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, size, format, args);
+    va_end(args);
+    if (n < 0)
+        return 0;
+    return ((size_t)n >= size) ? (int)(size - 1) : n;
+}
+
+Metric::Metric(MetricType _type, const char *_name, const char *_help, const char *_labels) : type(_type), name(_name), help(_help), next(NULL)
+{
+    set_labels(_labels);
+    // append, so that the exposition follows the declaration order
+    Metric **p = &head;
+    while (*p)
+        p = &((*p)->next);
+    *p = this;
+}
+
+void Metric::set_labels(const char *_labels)
+{
+    labels[0] = 0;
+    if (_labels)
+    {
+        strncpy(labels, _labels, METRIC_LABELS_SIZE - 1);
+        labels[METRIC_LABELS_SIZE - 1] = 0;
+    }
+}
+
+int Metric::write_labels(char *buffer, size_t size, const char *extra) const
+{
+    if (labels[0] && extra)
+        return append(buffer, size, "{%s,%s}", labels, extra);
+    else if (labels[0])
+        return append(buffer, size, "{%s}", labels);
+    else if (extra)
+        return append(buffer, size, "{%s}", extra);
+    return 0;
+}
+
+int MetricCounter::write(char *buffer, size_t size) const
+{
+    int n = append(buffer, size, "%s", name);
+    n += write_labels(buffer + n, size - n);
+    n += append(buffer + n, size - n, " %lu\n", get());
+    return n;
+}
+
+int MetricGauge::write(char *buffer, size_t size) const
+{
+    int n = append(buffer, size, "%s", name);
+    n += write_labels(buffer + n, size - n);
+    double v = get();
+    if (v != v)
+        n += append(buffer + n, size - n, " NaN\n");
+    else
+        n += append(buffer + n, size - n, " %g\n", v);
+    return n;
+}
+
+MetricCounterSet::MetricCounterSet(const char *_name, const char *_help, const char *_label) : Metric(METRIC_COUNTER, _name, _help), label(_label)
+{
+    for (int i = 0; i < METRIC_SET_SIZE; i++)
+    {
+        keys[i] = 0;
+        values[i] = 0;
+    }
+}
+
+void MetricCounterSet::inc(unsigned long key, unsigned long n)
+{
+    for (int i = 0; i < METRIC_SET_SIZE; i++)
+    {
+        unsigned long k = keys[i].load(std::memory_order_acquire);
+        if (k == 0)
+        {
+            // claim the free slot, unless someone else just did it
+            unsigned long expected = 0;
+            if (!keys[i].compare_exchange_strong(expected, key + 1) && expected != key + 1)
+                continue;
+            k = key + 1;
+        }
+        if (k == key + 1)
+        {
+            values[i].fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+    }
+    // no room left, the series is not tracked
+}
+
+unsigned long MetricCounterSet::get(unsigned long key) const
+{
+    for (int i = 0; i < METRIC_SET_SIZE; i++)
+    {
+        if (keys[i].load(std::memory_order_acquire) == key + 1)
+            return values[i].load(std::memory_order_relaxed);
+    }
+    return 0;
+}
+
+int MetricCounterSet::write(char *buffer, size_t size) const
+{
+    int n = 0;
+    char l[32];
+    for (int i = 0; i < METRIC_SET_SIZE; i++)
+    {
+        unsigned long k = keys[i].load(std::memory_order_acquire);
+        if (k == 0)
+            break;
+        snprintf(l, sizeof(l), "%s=\"%lu\"", label, k - 1);
+        n += append(buffer + n, size - n, "%s", name);
+        n += write_labels(buffer + n, size - n, l);
+        n += append(buffer + n, size - n, " %lu\n", values[i].load(std::memory_order_relaxed));
+    }
+    return n;
+}
+
+MetricHistogram::MetricHistogram(const char *_name, const char *_help, const unsigned long *_bounds, int _n_bounds, double _scale)
+    : Metric(METRIC_HISTOGRAM, _name, _help), bounds(_bounds), n_bounds(_n_bounds), scale(_scale), count(0), sum(0)
+{
+    if (n_bounds > HISTOGRAM_MAX_BUCKETS)
+        n_bounds = HISTOGRAM_MAX_BUCKETS;
+    for (int i = 0; i <= HISTOGRAM_MAX_BUCKETS; i++)
+        buckets[i] = 0;
+}
+
+void MetricHistogram::observe(unsigned long v)
+{
+    int i = 0;
+    while (i < n_bounds && v > bounds[i])
+        i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+}
+
+int MetricHistogram::write(char *buffer, size_t size) const
+{
+    int n = 0;
+    unsigned long cumulative = 0;
+    char le[32];
+    for (int i = 0; i <= n_bounds; i++)
+    {
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        if (i < n_bounds)
+            snprintf(le, sizeof(le), "le=\"%g\"", bounds[i] * scale);
+        else
+            strcpy(le, "le=\"+Inf\"");
+        n += append(buffer + n, size - n, "%s_bucket", name);
+        n += write_labels(buffer + n, size - n, le);
+        n += append(buffer + n, size - n, " %lu\n", cumulative);
+    }
+    n += append(buffer + n, size - n, "%s_sum", name);
+    n += write_labels(buffer + n, size - n);
+    n += append(buffer + n, size - n, " %g\n", sum.load(std::memory_order_relaxed) * scale);
+    n += append(buffer + n, size - n, "%s_count", name);
+    n += write_labels(buffer + n, size - n);
+    n += append(buffer + n, size - n, " %lu\n", count.load(std::memory_order_relaxed));
+    return n;
+}
+
+static bool same_family(const Metric *a, const Metric *b)
+{
+    return strcmp(a->get_name(), b->get_name()) == 0;
+}
+
+int Metrics::write_prometheus(char *buffer, size_t size)
+{
+    static const char *type_names[] = {"counter", "gauge", "histogram"};
+    int n = 0;
+    for (Metric *m = Metric::first(); m; m = m->get_next())
+    {
+        // a family (same name, different labels) is written once, at its first series
+        bool written = false;
+        for (Metric *p = Metric::first(); p != m && !written; p = p->get_next())
+            written = same_family(p, m);
+        if (written)
+            continue;
+        n += append(buffer + n, size - n, "# HELP %s %s\n# TYPE %s %s\n", m->get_name(), m->get_help(), m->get_name(), type_names[m->get_type()]);
+        for (Metric *s = m; s; s = s->get_next())
+        {
+            if (same_family(s, m))
+                n += s->write(buffer + n, size - n);
+        }
+    }
+    return n;
+}
+
+#ifndef ESP32_ARCH
+MetricsServer::~MetricsServer()
+{
+    close();
+}
+
+bool MetricsServer::open(int port)
+{
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        Log::trace("Err creating metrics socket {%d} {%s}\n", errno, strerror(errno));
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(fd, 4) < 0)
+    {
+        Log::trace("Err opening metrics port {%d} {%d} {%s}\n", port, errno, strerror(errno));
+        close();
+        return false;
+    }
+    Log::trace("Serving metrics on port {%d}\n", port);
+    return true;
+}
+
+void MetricsServer::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+void MetricsServer::poll()
+{
+    if (fd < 0)
+        return;
+    int client;
+    while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        serve(client);
+        ::close(client);
+    }
+}
+
+void MetricsServer::serve(int client)
+{
+    static char buffer[METRICS_BUFFER_SIZE];
+
+    // the request is not parsed, whatever the path the answer is the metrics page;
+    // just drain what has arrived so that closing does not reset the connection
+    ssize_t r = read(client, buffer, sizeof(buffer));
+    (void)r;
+
+    const char *header = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    int n = append(buffer, sizeof(buffer), "%s", header);
+    n += Metrics::write_prometheus(buffer + n, sizeof(buffer) - n);
+
+    // the page fits in the socket buffer, a client not reading it is dropped
+    int sent = 0;
+    while (sent < n)
+    {
+        ssize_t w = send(client, buffer + sent, n - sent, MSG_NOSIGNAL);
+        if (w <= 0)
+            break;
+        sent += w;
+    }
+}
+#endif
@@ -0,0 +1,161 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <stddef.h>
+
+#define METRIC_LABELS_SIZE 48
+#define HISTOGRAM_MAX_BUCKETS 16
+#define METRIC_SET_SIZE 16
+
+enum MetricType
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+};
+
+// metrics register themselves in a global list when constructed, the list is
+// meant to be built at startup (static objects) or from the thread serving it
+class Metric
+{
+public:
+    Metric(MetricType type, const char *name, const char *help, const char *labels = NULL);
+    virtual ~Metric() {}
+
+    void set_labels(const char *labels);
+
+    const char *get_name() const { return name; }
+    const char *get_help() const { return help; }
+    MetricType get_type() const { return type; }
+
+    // append the prometheus text exposition of the samples, returns the number of chars written
+    virtual int write(char *buffer, size_t size) const = 0;
+
+    static Metric *first() { return head; }
+    Metric *get_next() const { return next; }
+
+protected:
+    int write_labels(char *buffer, size_t size, const char *extra = NULL) const;
+
+    MetricType type;
+    const char *name;
+    const char *help;
+    char labels[METRIC_LABELS_SIZE];
+
+private:
+    Metric *next;
+    static Metric *head;
+};
+
+class MetricCounter : public Metric
+{
+public:
+    MetricCounter(const char *name, const char *help, const char *labels = NULL) : Metric(METRIC_COUNTER, name, help, labels), value(0) {}
+
+    void inc(unsigned long n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    unsigned long get() const { return value.load(std::memory_order_relaxed); }
+
+    int write(char *buffer, size_t size) const;
+
+private:
+    std::atomic<unsigned long> value;
+};
+
+class MetricGauge : public Metric
+{
+public:
+    MetricGauge(const char *name, const char *help, const char *labels = NULL) : Metric(METRIC_GAUGE, name, help, labels), value(0) {}
+
+    void set(double v) { value.store(v, std::memory_order_relaxed); }
+    double get() const { return value.load(std::memory_order_relaxed); }
+
+    int write(char *buffer, size_t size) const;
+
+private:
+    std::atomic<double> value;
+};
+
+// counter family keyed by one numeric label (e.g. the PGN), up to METRIC_SET_SIZE series
+class MetricCounterSet : public Metric
+{
+public:
+    MetricCounterSet(const char *name, const char *help, const char *label);
+
+    void inc(unsigned long key, unsigned long n = 1);
+    unsigned long get(unsigned long key) const;
+
+    int write(char *buffer, size_t size) const;
+
+private:
+    const char *label;
+    std::atomic<unsigned long> keys[METRIC_SET_SIZE]; // key + 1, 0 = free slot
+    std::atomic<unsigned long> values[METRIC_SET_SIZE];
+};
+
+// fixed buckets on integer observations (e.g. microseconds), "scale" converts
+// them to the exposed unit (e.g. 1e-6 to expose seconds)
+class MetricHistogram : public Metric
+{
+public:
+    MetricHistogram(const char *name, const char *help, const unsigned long *bounds, int n_bounds, double scale = 1.0);
+
+    void observe(unsigned long v);
+
+    int write(char *buffer, size_t size) const;
+
+private:
+    const unsigned long *bounds;
+    int n_bounds;
+    double scale;
+    std::atomic<unsigned long> buckets[HISTOGRAM_MAX_BUCKETS + 1];
+    std::atomic<unsigned long> count;
+    std::atomic<unsigned long long> sum;
+};
+
+class Metrics
+{
+public:
+    // write all the registered metrics in prometheus text format, returns the length
+    static int write_prometheus(char *buffer, size_t size);
+};
+
+#ifndef ESP32_ARCH
+// minimal HTTP endpoint serving /metrics, polled from the main loop
+class MetricsServer
+{
+public:
+    MetricsServer() : fd(-1) {}
+    ~MetricsServer();
+
+    bool open(int port);
+    void close();
+
+    // accept and serve pending scrapes without blocking
+    void poll();
+
+    int get_fd() const { return fd; }
+
+private:
+    void serve(int client);
+
+    int fd;
+};
+#endif
+
+#endif
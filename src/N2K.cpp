@@ -18,39 +18,270 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 #define ESP32_CAN_TX_PIN GPIO_NUM_5  // Set CAN TX port to 5 
 #define ESP32_CAN_RX_PIN GPIO_NUM_4  // Set CAN RX port to 4
 #include <NMEA2000_CAN.h>
+#include <Preferences.h>
 #else
-#define USE_N2K_CAN USE_N2K_SOCKET_CAN
-char my_can_device[32]; 
-#define SOCKET_CAN_PORT my_can_device
-#include "NMEA2000_CAN.h"
+#include "N2KSocketCAN.h"
+#include <fcntl.h>
+#include <unistd.h>
+static N2KSocketCAN can_bus;
+tNMEA2000 &NMEA2000 = can_bus;
 #endif
 
 #include <time.h>
 #include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
 #include "N2K.h"
 #include "Utils.h"
 #include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+static MetricCounterSet m_sent("n2k_messages_sent_total", "N2K messages sent", "pgn");
+static MetricCounterSet m_failed("n2k_messages_failed_total", "N2K messages the library refused to send", "pgn");
+static MetricGauge m_bus_load("n2k_bus_load_percent", "CAN bus utilisation over the last 5s, from the frames seen by the node");
+static MetricGauge m_throttle("n2k_throttle_factor", "Stretch of the non-critical PGN intervals because of the bus load, 1 = none");
+static MetricCounterSet m_skipped("n2k_messages_skipped_total", "N2K messages left out because of the transmission interval", "pgn");
+
+#define N2K_DEFAULT_PRIORITY 6
+#define PRIORITY_NO_CHANGE 8
+#define PRIORITY_RESTORE 9
+#define INTERVAL_NO_CHANGE 0xFFFFFFFF
+#define INTERVAL_RESTORE 0xFFFFFFFE
+
+// group function 126208 on a periodic PGN: the request sets the interval, the command the priority
+class N2KTransmissionHandler : public tN2kGroupFunctionHandler
+{
+public:
+    N2KTransmissionHandler(N2K *_n2k, unsigned long _pgn) : tN2kGroupFunctionHandler(&NMEA2000, _pgn), n2k(_n2k), pgn(_pgn) {}
+
+protected:
+    bool HandleRequest(const tN2kMsg &N2kMsg, uint32_t TransmissionInterval, uint16_t TransmissionIntervalOffset, uint8_t NumberOfParameterPairs, int iDev);
+    bool HandleCommand(const tN2kMsg &N2kMsg, uint8_t PrioritySetting, uint8_t NumberOfParameterPairs, int iDev);
+
+private:
+    N2K *n2k;
+    unsigned long pgn;
+};
+
+bool N2KTransmissionHandler::HandleRequest(const tN2kMsg &N2kMsg, uint32_t TransmissionInterval, uint16_t TransmissionIntervalOffset, uint8_t NumberOfParameterPairs, int iDev) {
+    tN2kGroupFunctionTransmissionOrPriorityErrorCode result = N2kgfTPec_Acknowledge;
+    if (TransmissionInterval == INTERVAL_NO_CHANGE) {
+        // a plain request: the next frame goes out on every instance, the answer is the PGN itself
+        N2KTransmission *t = n2k->get_transmission(pgn);
+        memset(t->sent, 0, sizeof(t->sent));
+        return true;
+    }
+    if (TransmissionInterval == INTERVAL_RESTORE)
+        n2k->set_interval(pgn, 0);
+    else if (TransmissionInterval != 0 && TransmissionInterval < N2K_MEASUREMENT_INTERVAL)
+        result = N2kgfTPec_TransmitIntervalIsLessThanMeasurementInterval;
+    else if (TransmissionInterval > N2K_MAX_INTERVAL)
+        result = N2kgfTPec_TransmitIntervalOrPriorityNotSupported;
+    else
+        n2k->set_interval(pgn, TransmissionInterval);
+    Log::trace("N2K interval request {%lu} {%lu ms} from {%d} {%s}\n", pgn, (unsigned long)TransmissionInterval, N2kMsg.Source,
+               result == N2kgfTPec_Acknowledge ? "OK" : "refused");
+    SendAcknowledge(pNMEA2000, N2kMsg.Source, iDev, pgn, N2kgfPGNec_Acknowledge, result, NumberOfParameterPairs);
+    return true;
+}
+
+bool N2KTransmissionHandler::HandleCommand(const tN2kMsg &N2kMsg, uint8_t PrioritySetting, uint8_t NumberOfParameterPairs, int iDev) {
+    tN2kGroupFunctionTransmissionOrPriorityErrorCode result = N2kgfTPec_Acknowledge;
+    if (PrioritySetting == PRIORITY_RESTORE)
+        n2k->set_priority(pgn, N2K_DEFAULT_PRIORITY);
+    else if (PrioritySetting <= 7)
+        n2k->set_priority(pgn, PrioritySetting);
+    else if (PrioritySetting != PRIORITY_NO_CHANGE)
+        result = N2kgfTPec_TransmitIntervalOrPriorityNotSupported;
+    Log::trace("N2K priority command {%lu} {%d} from {%d} {%s}\n", pgn, PrioritySetting, N2kMsg.Source,
+               result == N2kgfTPec_Acknowledge ? "OK" : "refused");
+    SendAcknowledge(pNMEA2000, N2kMsg.Source, iDev, pgn, N2kgfPGNec_Acknowledge, result, NumberOfParameterPairs);
+    return true;
+}
 
 void (*_handler)(const tN2kMsg &N2kMsg);
 
 bool N2K::sendBattery(unsigned char sid, const double voltage, const double current, const double temperature, const unsigned char instance) {
+    N2KTransmission &t = transmissions[0];
+    if (!is_due(t, instance))
+        return true;
     tN2kMsg m(src);
+    TRACE_BEGIN("n2k.encode.127508");
     SetN2kPGN127508(m, instance, voltage, current, temperature, sid);
+    m.Priority = t.priority;
+    TRACE_END("n2k.encode.127508");
     return send_msg(m);
 }
 
-bool N2K::sendBatteryStatus(unsigned char sid, const double soc, const double capacity, const double ttg, const unsigned char instance) {
+bool N2K::sendBatteryStatus(unsigned char sid, const double soc, const double capacity, const double ttg, const unsigned char instance, const double soh) {
+    N2KTransmission &t = transmissions[1];
+    if (!is_due(t, instance))
+        return true;
     tN2kMsg m(src);
-    SetN2kPGN127506(m, sid, instance, tN2kDCType::N2kDCt_Battery, soc, 100, ttg, N2kDoubleNA, capacity * 3600);
+    TRACE_BEGIN("n2k.encode.127506");
+    SetN2kPGN127506(m, sid, instance, tN2kDCType::N2kDCt_Battery, soc, soh, ttg, N2kDoubleNA, (capacity == N2kDoubleNA) ? N2kDoubleNA : capacity * 3600);
+    m.Priority = t.priority;
+    TRACE_END("n2k.encode.127506");
     return send_msg(m);
 }
 
+bool N2K::is_due(N2KTransmission &t, unsigned char instance) {
+    unsigned long interval = t.interval;
+    if (throttle > 1 && !t.critical)
+        interval = (interval ? interval : N2K_MEASUREMENT_INTERVAL) * throttle;
+    if (interval == 0)
+        return true;
+    unsigned long now = _millis();
+    // frames jitter around their period: a tenth of the interval early is on time
+    if (t.sent[instance] && now - t.last_sent[instance] < interval - interval / 10) {
+        m_skipped.inc(t.pgn);
+        return false;
+    }
+    t.sent[instance] = true;
+    t.last_sent[instance] = now;
+    return true;
+}
+
+N2KTransmission *N2K::get_transmission(unsigned long pgn) {
+    for (int i = 0; i < N2K_PERIODIC_PGNS; i++)
+        if (transmissions[i].pgn == pgn)
+            return &transmissions[i];
+    return NULL;
+}
+
+bool N2K::set_interval(unsigned long pgn, unsigned long interval) {
+    N2KTransmission *t = get_transmission(pgn);
+    if (t == NULL || interval > N2K_MAX_INTERVAL || (interval && interval < N2K_MEASUREMENT_INTERVAL))
+        return false;
+    t->interval = interval;
+    save_settings();
+    return true;
+}
+
+bool N2K::set_priority(unsigned long pgn, unsigned char priority) {
+    N2KTransmission *t = get_transmission(pgn);
+    if (t == NULL || priority > 7)
+        return false;
+    t->priority = priority;
+    save_settings();
+    return true;
+}
+
+#ifdef ESP32_ARCH
+void N2K::load_settings() {
+    Preferences prefs;
+    prefs.begin("n2k", true);
+    for (int i = 0; i < N2K_PERIODIC_PGNS; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "i%lu", transmissions[i].pgn);
+        transmissions[i].interval = prefs.getULong(key, 0);
+        snprintf(key, sizeof(key), "p%lu", transmissions[i].pgn);
+        transmissions[i].priority = prefs.getUChar(key, transmissions[i].default_priority);
+    }
+    prefs.end();
+}
+
+void N2K::save_settings() {
+    Preferences prefs;
+    prefs.begin("n2k", false);
+    for (int i = 0; i < N2K_PERIODIC_PGNS; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "i%lu", transmissions[i].pgn);
+        prefs.putULong(key, transmissions[i].interval);
+        snprintf(key, sizeof(key), "p%lu", transmissions[i].pgn);
+        prefs.putUChar(key, transmissions[i].priority);
+    }
+    prefs.end();
+}
+#else
+void N2K::load_settings() {
+    // "<pgn> <interval ms> <priority>" per line, missing file = defaults
+    FILE *f = fopen(settings_file, "r");
+    if (f == NULL)
+        return;
+    unsigned long pgn, interval;
+    unsigned int priority;
+    while (fscanf(f, "%lu %lu %u", &pgn, &interval, &priority) == 3) {
+        N2KTransmission *t = get_transmission(pgn);
+        if (t && priority <= 7 && interval <= N2K_MAX_INTERVAL && (interval == 0 || interval >= N2K_MEASUREMENT_INTERVAL)) {
+            t->interval = interval;
+            t->priority = priority;
+        }
+    }
+    fclose(f);
+}
+
+void N2K::save_settings() {
+    // replaced in one go, a crash leaves the old file or the new one; it runs when
+    // a node asks for it, so no stdio: open/write/rename do not touch the heap
+    char tmp[256];
+    char buffer[N2K_PERIODIC_PGNS * 32];
+    int len = 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", settings_file);
+    for (int i = 0; i < N2K_PERIODIC_PGNS; i++)
+        len += snprintf(buffer + len, sizeof(buffer) - len, "%lu %lu %d\n", transmissions[i].pgn, transmissions[i].interval, transmissions[i].priority);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        Log::trace("Err saving N2K settings {%s} {%d} {%s}\n", tmp, errno, strerror(errno));
+        return;
+    }
+    bool ok = write(fd, buffer, len) == len;
+    if (close(fd) != 0 || !ok || rename(tmp, settings_file) != 0)
+        Log::trace("Err saving N2K settings {%s} {%d} {%s}\n", settings_file, errno, strerror(errno));
+}
+#endif
+
 void private_message_handler(const tN2kMsg &N2kMsg) {
     _handler(N2kMsg);
 }
 
 void N2K::loop() {
-    NMEA2000.ParseMessages();
+    if (!null_device)
+        NMEA2000.ParseMessages();
+    flush();
+    check_load(_millis());
+}
+
+void N2K::check_load(unsigned long now) {
+    #ifndef ESP32_ARCH
+    if (null_device || now - last_load_check < N2K_LOAD_CHECK)
+        return;
+    last_load_check = now;
+    BusLoad &load = can_bus.get_load();
+    double percent = load.get_load(now);
+    unsigned long congestion = load.get_congestion(now);
+    m_bus_load.set(percent);
+    // a full window after the last step, so that it only sees its effect
+    if (now - last_throttle_change < (unsigned long)BUS_LOAD_SLOTS * BUS_LOAD_SLOT_MS)
+        return;
+    int t = throttle;
+    if ((percent >= load_high || congestion) && throttle < N2K_THROTTLE_MAX)
+        t = throttle * 2;
+    else if (percent < load_low && congestion == 0 && throttle > 1)
+        t = throttle / 2;
+    if (t != throttle) {
+        Log::trace("N2K bus load {%.1f%%} congestion {%lu} intervals stretched {x%d}\n", percent, congestion, t);
+        throttle = t;
+        last_throttle_change = now;
+        m_throttle.set(t);
+    }
+    #endif
+}
+
+void N2K::flush() {
+    #ifndef ESP32_ARCH
+    can_bus.flush(_millis());
+    #endif
+}
+
+long N2K::next_timeout(unsigned long now, long max_wait) {
+    #ifndef ESP32_ARCH
+    return can_bus.next_timeout(now, max_wait);
+    #else
+    return max_wait;
+    #endif
 }
 
 bool N2K::sendMessage(int dest, unsigned long pgn, int priority, int len, unsigned char* payload) {
@@ -71,11 +302,25 @@ bool N2K::sendMessageWithSource(int overrideSrc, int dest, unsigned long pgn, in
 void N2K::setup(void (*_MsgHandler)(const tN2kMsg &N2kMsg), uint8_t _src, char* device) {
 
     #ifndef ESP32_ARCH
-    strcpy(my_can_device, device);
+    can_bus.set_device(device);
     #endif
 
     src = _src;
     _handler = _MsgHandler;
+    static const unsigned long periodic[N2K_PERIODIC_PGNS] = {127508, 127506};
+    for (int i = 0; i < N2K_PERIODIC_PGNS; i++) {
+        memset(&transmissions[i], 0, sizeof(N2KTransmission));
+        transmissions[i].pgn = periodic[i];
+        transmissions[i].priority = transmissions[i].default_priority = N2K_DEFAULT_PRIORITY;
+    }
+    // voltage and current are what a display shows first, SOC and TTG can wait
+    transmissions[0].critical = true;
+    m_throttle.set(throttle);
+    null_device = device && strcmp(device, N2K_NULL_DEVICE) == 0;
+    if (null_device) {
+        Log::trace("Initializing N2K on the null device, messages are discarded\n");
+        return;
+    }
     Log::trace("Initializing N2K\n");
     NMEA2000.SetN2kCANSendFrameBufSize(150);
     NMEA2000.SetN2kCANReceiveFrameBufSize(150),
@@ -99,6 +344,13 @@ void N2K::setup(void (*_MsgHandler)(const tN2kMsg &N2kMsg), uint8_t _src, char*
     //NMEA2000.SetMode(tNMEA2000::N2km_ListenAndNode, src);
     //NMEA2000.SetMsgHandler(private_message_handler);
     NMEA2000.EnableForward(false); // Disable all msg forwarding to USB (=Serial)
+    // transmission interval and priority can be changed from the bus
+    load_settings();
+    for (int i = 0; i < N2K_PERIODIC_PGNS; i++) {
+        NMEA2000.AddGroupFunctionHandler(new N2KTransmissionHandler(this, transmissions[i].pgn));
+        if (transmissions[i].interval || transmissions[i].priority != N2K_DEFAULT_PRIORITY)
+            Log::trace("N2K {%lu} every {%lu ms} priority {%d}\n", transmissions[i].pgn, transmissions[i].interval, transmissions[i].priority);
+    }
     Log::trace("Initializing N2K Port & Handlers\n");
     bool initialized = NMEA2000.Open();
     Log::trace("Initializing N2K %s\n", initialized?"OK":"KO");
@@ -106,10 +358,13 @@ void N2K::setup(void (*_MsgHandler)(const tN2kMsg &N2kMsg), uint8_t _src, char*
 }
 
 bool N2K::send_msg(const tN2kMsg &N2kMsg) {
+    TRACE_SCOPE("n2k.send");
     _handler(N2kMsg);
-    if (NMEA2000.SendMsg(N2kMsg)) {
+    if (null_device || NMEA2000.SendMsg(N2kMsg)) {
+        m_sent.inc(N2kMsg.PGN);
         return true;
     } else {
+        m_failed.inc(N2kMsg.PGN);
         Log::trace("Failed message {%d}\n", N2kMsg.PGN);
         return false;
     }
@@ -18,6 +18,32 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <N2kMessages.h>
 
+// CAN device name that discards the messages (replay and benchmarks)
+#define N2K_NULL_DEVICE "null"
+
+// transmission of the periodic PGNs, changed from the bus with group function 126208
+#define N2K_PERIODIC_PGNS 2           // 127508 and 127506
+#define N2K_MEASUREMENT_INTERVAL 1000 // ms between ve.direct frames, shorter intervals are refused
+#define N2K_MAX_INTERVAL 3600000      // ms
+#define N2K_SETTINGS_FILE "/var/lib/vedirectN2K/n2k.conf"
+
+// bus load: the non-critical PGNs are stretched while the bus is busy
+#define N2K_LOAD_HIGH 70    // %, above this (or on congestion) the stretch doubles
+#define N2K_LOAD_LOW 40     // %, below this it halves
+#define N2K_THROTTLE_MAX 8  // the intervals are stretched at most 8 times
+#define N2K_LOAD_CHECK 1000 // ms between evaluations
+
+struct N2KTransmission
+{
+    unsigned long pgn;
+    unsigned long interval; // ms, 0 = every frame
+    unsigned char priority;
+    unsigned char default_priority;
+    bool critical;          // never stretched on a busy bus
+    unsigned long last_sent[256]; // ms, per instance
+    bool sent[256];
+};
+
 class N2K {
 
     public:
@@ -25,16 +51,52 @@ class N2K {
         bool sendMessage(int dest, unsigned long pgn, int priority, int len, unsigned char* payload);
         bool sendMessageWithSource(int overrideSrc, int dest, unsigned long pgn, int priority, int len, unsigned char* payload);
         bool sendBattery(unsigned char sid, const double voltage, const double current, const double temperature, const unsigned char instance);
-        bool sendBatteryStatus(unsigned char sid, const double soc, const double capacity, const double ttg, const unsigned char instance);
+        bool sendBatteryStatus(unsigned char sid, const double soc, const double capacity, const double ttg, const unsigned char instance, const double soh = 100);
 
         void setup(void (*_MsgHandler)(const tN2kMsg &N2kMsg), uint8_t src, char* can_device = NULL);
 
         void loop();
 
+        // hand the messages queued so far to the bus (one syscall on socketCAN)
+        void flush();
+
+        // ms to wait from "now" before a postponed flush is due, capped at max_wait
+        long next_timeout(unsigned long now, long max_wait);
+
         bool send_msg(const tN2kMsg &N2kMsg);
 
+        // the transmission settings of a periodic PGN, NULL for any other PGN
+        N2KTransmission *get_transmission(unsigned long pgn);
+
+        // apply and persist, interval in ms (0 = every frame), priority 0..7
+        bool set_interval(unsigned long pgn, unsigned long interval);
+        bool set_priority(unsigned long pgn, unsigned char priority);
+
+        // where the settings are kept (Linux only, the ESP32 uses its NVS)
+        void set_settings_file(const char *path) { settings_file = path; }
+
+        // bus load thresholds in %, the stretch doubles above high and halves below low
+        void set_load_thresholds(int high, int low) { load_high = high; load_low = low; }
+
+        // current stretch of the non-critical intervals, 1 = none
+        int get_throttle() const { return throttle; }
+
     private:
+        bool is_due(N2KTransmission &t, unsigned char instance);
+        void load_settings();
+        void save_settings();
+        void check_load(unsigned long now);
+
         uint8_t src;
+        bool null_device = false;
+        const char *settings_file = N2K_SETTINGS_FILE;
+        N2KTransmission transmissions[N2K_PERIODIC_PGNS];
+
+        int load_high = N2K_LOAD_HIGH;
+        int load_low = N2K_LOAD_LOW;
+        int throttle = 1;
+        unsigned long last_load_check = 0;
+        unsigned long last_throttle_change = 0;
 };
 
 #endif
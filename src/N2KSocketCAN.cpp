@@ -0,0 +1,179 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESP32_ARCH
+
+#include "N2KSocketCAN.h"
+#include "Utils.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+
+static MetricCounter m_frames("n2k_can_frames_sent_total", "CAN frames written to the socket");
+static MetricCounter m_calls("n2k_can_send_calls_total", "sendmmsg calls on the CAN socket");
+static MetricCounter m_backoff("n2k_can_tx_backoff_total", "Flushes postponed because the interface queue was full");
+static MetricCounter m_queue_full("n2k_can_tx_queue_full_total", "Frames refused because the batch was full, left to the library buffer");
+static MetricCounter m_dropped("n2k_can_tx_dropped_total", "Frames dropped on socket errors");
+
+N2KSocketCAN::N2KSocketCAN() : tNMEA2000(), fd(-1), n_pending(0), backoff(0), backoff_until(0)
+{
+    device[0] = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < CAN_TX_BATCH; i++)
+    {
+        // the slots never move, pending frames are shifted within them
+        iov[i].iov_base = &pending[i];
+        iov[i].iov_len = sizeof(struct can_frame);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+void N2KSocketCAN::set_device(const char *name)
+{
+    strncpy(device, name, CAN_DEVICE_SIZE - 1);
+    device[CAN_DEVICE_SIZE - 1] = 0;
+}
+
+bool N2KSocketCAN::CANOpen()
+{
+    if (strlen(device) >= IFNAMSIZ)
+    {
+        Log::trace("Err CAN device name too long {%s} {max %d chars}\n", device, IFNAMSIZ - 1);
+        return false;
+    }
+    fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd < 0)
+    {
+        Log::trace("Err opening CAN socket {%d} {%s}\n", errno, strerror(errno));
+        return false;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%s", device);
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    bool ok = ioctl(fd, SIOCGIFINDEX, &ifr) == 0;
+    if (ok)
+    {
+        addr.can_ifindex = ifr.ifr_ifindex;
+        ok = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0;
+    }
+    if (!ok)
+    {
+        Log::trace("Err binding CAN device {%s} {%d} {%s}\n", device, errno, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    Log::trace("CAN device {%s} open, batches of {%d} frames\n", device, CAN_TX_BATCH);
+    return true;
+}
+
+bool N2KSocketCAN::CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent)
+{
+    if (fd < 0)
+        return false;
+    if (n_pending == CAN_TX_BATCH && flush(_millis()) == CAN_TX_BATCH)
+    {
+        m_queue_full.inc();
+        return false;
+    }
+    struct can_frame &f = pending[n_pending++];
+    f.can_id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    f.can_dlc = len > 8 ? 8 : len;
+    memcpy(f.data, buf, f.can_dlc);
+    return true;
+}
+
+int N2KSocketCAN::flush(unsigned long now)
+{
+    if (fd < 0 || n_pending == 0)
+        return n_pending;
+    if (backoff && (long)(now - backoff_until) < 0)
+        return n_pending;
+    TRACE_SCOPE("can.flush");
+    int sent = 0;
+    int dropped = 0;
+    while (sent < n_pending)
+    {
+        m_calls.inc();
+        int r = sendmmsg(fd, msgs + sent, n_pending - sent, MSG_DONTWAIT);
+        if (r > 0)
+        {
+            sent += r;
+            backoff = 0;
+        }
+        else if (r < 0 && (errno == ENOBUFS || errno == EAGAIN))
+        {
+            // the tx queue of the interface is full, give the bus time to drain it
+            m_backoff.inc();
+            backoff = backoff ? (backoff * 2 > CAN_BACKOFF_MAX ? CAN_BACKOFF_MAX : backoff * 2) : CAN_BACKOFF_MIN;
+            backoff_until = now + backoff;
+            load.congestion(now);
+            break;
+        }
+        else
+        {
+            Log::trace("Err sending CAN frames {%d} {%s}, dropped {%d}\n", errno, strerror(errno), n_pending - sent);
+            m_dropped.inc(n_pending - sent);
+            load.congestion(now);
+            dropped = n_pending - sent;
+            sent = n_pending;
+            break;
+        }
+    }
+    m_frames.inc(sent - dropped);
+    for (int i = 0; i < sent - dropped; i++)
+        load.frame(now, pending[i].can_dlc);
+    n_pending -= sent;
+    if (n_pending && sent)
+        memmove(pending, pending + sent, n_pending * sizeof(struct can_frame));
+    return n_pending;
+}
+
+long N2KSocketCAN::next_timeout(unsigned long now, long max_wait)
+{
+    if (n_pending == 0)
+        return max_wait;
+    long wait = backoff ? (long)(backoff_until - now) : 0;
+    if (wait < 0)
+        wait = 0;
+    return wait < max_wait ? wait : max_wait;
+}
+
+bool N2KSocketCAN::CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf)
+{
+    if (fd < 0)
+        return false;
+    struct can_frame f;
+    if (read(fd, &f, sizeof(f)) != sizeof(f))
+        return false;
+    load.frame(_millis(), f.can_dlc);
+    id = f.can_id & CAN_EFF_MASK;
+    len = f.can_dlc > 8 ? 8 : f.can_dlc;
+    memcpy(buf, f.data, len);
+    return true;
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef N2K_SOCKETCAN_H
+#define N2K_SOCKETCAN_H
+
+#ifndef ESP32_ARCH
+
+#include <NMEA2000.h>
+#include "BusLoad.h"
+#include <linux/can.h>
+#include <sys/socket.h>
+
+#define CAN_TX_BATCH 32      // frames sent with one sendmmsg
+#define CAN_BACKOFF_MIN 1    // ms, first wait after the interface queue is full (ENOBUFS)
+#define CAN_BACKOFF_MAX 64   // ms, the wait doubles up to this
+#define CAN_DEVICE_SIZE 32
+
+// socketCAN backend for the NMEA2000 library with batched transmission:
+// the frames handed over by the library are collected and written with one
+// sendmmsg per flush() instead of one write per frame. When the interface
+// queue is full the flush backs off and the frames are kept; once the batch is
+// full too, frames are refused and the library keeps them in its own buffer.
+class N2KSocketCAN : public tNMEA2000
+{
+public:
+    N2KSocketCAN();
+
+    void set_device(const char *name);
+
+    // send the collected frames, returns the number still pending
+    int flush(unsigned long now);
+
+    // ms to wait from "now" before a postponed flush is due, capped at max_wait
+    long next_timeout(unsigned long now, long max_wait);
+
+    // utilisation of the bus, from the frames read and written on the socket
+    BusLoad &get_load() { return load; }
+
+protected:
+    bool CANSendFrame(unsigned long id, unsigned char len, const unsigned char *buf, bool wait_sent = true);
+    bool CANOpen();
+    bool CANGetFrame(unsigned long &id, unsigned char &len, unsigned char *buf);
+
+private:
+    char device[CAN_DEVICE_SIZE];
+    int fd;
+
+    struct can_frame pending[CAN_TX_BATCH];
+    struct iovec iov[CAN_TX_BATCH];
+    struct mmsghdr msgs[CAN_TX_BATCH];
+    int n_pending;
+
+    unsigned long backoff;       // ms, 0 when not backing off
+    unsigned long backoff_until; // ms
+
+    BusLoad load;
+};
+
+#endif
+
+#endif
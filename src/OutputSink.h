@@ -0,0 +1,40 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include "Battery.h"
+#include "BatteryAnalytics.h"
+
+// destination for decoded battery values, next to N2K
+// publish() is called for each battery of a frame, flush() once the frame is complete;
+// implementations must never block the caller
+class OutputSink
+{
+public:
+    virtual ~OutputSink() {}
+
+    virtual void publish(const BatteryReading &r, const BatteryStats &stats, unsigned char instance, unsigned char instance_e) = 0;
+    virtual void flush() = 0;
+
+    // housekeeping from the main loop (e.g. accepting clients)
+    virtual void poll() {}
+
+    // handle the main loop should wait on, -1 if none
+    virtual int get_fd() const { return -1; }
+};
+
+#endif
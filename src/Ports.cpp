@@ -15,244 +15,442 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <string.h>
+#include <errno.h>
 #include "Utils.h"
 
 #ifdef ESP32_ARCH
 #include <Arduino.h>
-#else
-#include <fcntl.h>
-#include <termios.h>
-#include <string.h>
-#include <errno.h>
 #endif
 
 #include "Ports.h"
 #include "Log.h"
+#include "Scan.h"
+#include "Trace.h"
+#include "VeDirect.h"
+#include "Metrics.h"
+#ifndef ESP32_ARCH
+#include "Rebroadcast.h"
+#endif
 
-#define NOTHING_TO_READ_ERROR 11
+// a line let through by the framer must fit the parser buffers
+static_assert(PORT_MAX_LINE < VE_LINE_SIZE, "ve.direct lines longer than the parser buffers");
 
-#define INIT_PORT(_rx, _tx, _speed, _name) \
-	fun = NULL;                            \
-	tty_fd = 0;                            \
-	speed = _speed;                        \
-	last_speed = _speed;                   \
-	rx = _rx;                              \
-	tx = _tx;                              \
-	last_stats = _millis();                \
-	bytes_read_stats = 0;                  \
-	port = strdup(_name);
+static MetricCounter m_bytes("vedirect_bytes_read_total", "Bytes read from the ve.direct port");
+static MetricCounter m_frames("vedirect_frames_total", "Frames received with a valid checksum");
+static MetricCounter m_checksum_failures("vedirect_checksum_failures_total", "Frames discarded because of a wrong checksum");
+static MetricCounter m_buffer_full("vedirect_buffer_full_total", "Read buffer overruns");
+static MetricCounter m_resyncs("vedirect_resyncs_total", "Times the framing was lost and picked up again at the next line");
+static MetricCounter m_bytes_lost("vedirect_bytes_lost_total", "Bytes dropped while resynchronising or in invalid frames");
+static MetricCounter m_reopen("vedirect_reopen_attempts_total", "Attempts to open the ve.direct port");
 
-#ifdef ESP32_ARCH
-VEDirectPort::VEDirectPort(unsigned int _rx, unsigned int _tx, unsigned int _speed)
+VEDirectPort::VEDirectPort(const char *port_name, unsigned int _speed)
 {
-	INIT_PORT(_rx, _tx, _speed, "dummy");
+	fun = NULL;
+	speed = _speed;
+	last_speed = _speed;
+	last_stats = _millis();
+	bytes_read_stats = 0;
+	resyncs_stats = 0;
+	bytes_lost_stats = 0;
+	set_port(port_name);
+	reset();
 }
 
-void VEDirectPort::close()
+static const char *end_string = "Checksum\t";
+#define END_STRING_LEN 9
+
+static bool is_label_char(char c)
 {
-	Serial2.end();
-	tty_fd = 0;
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '#' || c == '_';
 }
 
-int VEDirectPort::open()
+static bool is_value_char(char c)
 {
-	Log::trace("Opening serial port ");
-	Serial2.begin(speed, SERIAL_8N1, rx, tx);
-	tty_fd = 1;
-	Log::trace("Ok\n");
-	return tty_fd > 0;
+	return c >= 0x20 && c <= 0x7E;
 }
 
-unsigned char _read_char(int tty_fd, int &bread, int &read_error)
+// "Checksum" with one byte changed, lost or added: the end of a frame that went wrong
+static bool near_checksum(const char *label, int len)
 {
-	int _c = Serial2.read();
-	bread = (_c != -1) ? 1 : 0;
-	read_error = (_c != -1) ? NOTHING_TO_READ_ERROR : 0; // simulate
-	return (unsigned char)_c;
+	const char *c = end_string;
+	int n = END_STRING_LEN - 1;
+	if (len < n - 1 || len > n + 1)
+		return false;
+	int i = 0;
+	while (i < len && i < n && label[i] == c[i])
+		i++;
+	if (len == n)
+		return i == n || memcmp(label + i + 1, c + i + 1, n - i - 1) == 0;
+	if (len < n)
+		return memcmp(label + i, c + i + 1, n - i - 1) == 0;
+	return memcmp(label + i + 1, c + i, n - i) == 0;
 }
-#else
-VEDirectPort::VEDirectPort(const char *port_name, unsigned int _speed)
+
+// the first bytes of an invalid frame, readable
+static const char *escape(const char *s, unsigned int len)
 {
-	INIT_PORT(0, 0, _speed, port_name);
+	static char buffer[PORT_TRACE_BYTES * 4 + 4];
+	int n = 0;
+	for (unsigned int i = 0; i < len && i < PORT_TRACE_BYTES; i++)
+	{
+		unsigned char c = s[i];
+		if (c >= 0x20 && c <= 0x7E && c != '\\')
+			buffer[n++] = c;
+		else
+			n += sprintf(buffer + n, "\\x%02x", c);
+	}
+	if (len > PORT_TRACE_BYTES)
+		n += sprintf(buffer + n, "...");
+	buffer[n] = 0;
+	return buffer;
 }
 
-int fd_set_blocking(int fd, int blocking)
+VEDirectPort::~VEDirectPort()
 {
-	// Save the current flags
-	int flags = fcntl(fd, F_GETFL, 0);
-	if (flags == -1)
-		return 0;
-
-	if (blocking)
-		flags &= ~O_NONBLOCK;
-	else
-		flags |= O_NONBLOCK;
-	return fcntl(fd, F_SETFL, flags) != -1;
 }
 
-void VEDirectPort::close()
+void VEDirectPort::set_handler(int (*fun)(const char *, void *), void *ctx)
 {
-	::close(tty_fd);
-	tty_fd = 0;
+	VEDirectPort::fun = fun;
+	fun_ctx = ctx;
 }
 
-int VEDirectPort::open()
+void VEDirectPort::reset()
 {
-	struct termios tio;
-
-	memset(&tio, 0, sizeof(tio));
-	tio.c_iflag = 0;
-	tio.c_oflag = 0;
-	tio.c_cflag = CS8 | CREAD | CLOCAL; // 8n1, see termios.h for more information
-	tio.c_lflag = 0;
-	tio.c_cc[VMIN] = 1;
-	tio.c_cc[VTIME] = 5;
-
-	Log::trace("Opening port {%s}\n", port);
-
-	// reset error
-	errno = 0;
+	read_buffer[0] = 0;
+	pos = 0;
+	last_start_line = 0;
+	tab_pos = -1;
+	phase = PHASE_IDLE;
+	synced = false;
+	n_fields = 0;
+	label_mask = 0;
+}
 
-	tty_fd = ::open(port, O_RDONLY | O_NONBLOCK); // O_NONBLOCK might override VMIN and VTIME, so read() may return immediately.
-	if (tty_fd > 0)
+void VEDirectPort::append(const unsigned char *data, int len)
+{
+	if (pos + len >= PORT_BUFFER_SIZE)
 	{
-		fd_set_blocking(tty_fd, 0);
-		cfsetospeed(&tio, B19200);
-		cfsetispeed(&tio, B19200);
-		tcsetattr(tty_fd, TCSANOW, &tio);
+		// avoid overruning buffer
+		Log::trace("Buffer full\n");
+		m_buffer_full.inc();
+		reset();
+		if (len >= PORT_BUFFER_SIZE)
+			return;
 	}
-
-	Log::trace("Err opening port {%s} {%d} {%s}\n", port, errno, strerror(errno));
-
-	return tty_fd > 0;
+	memcpy(read_buffer + pos, data, len);
+	pos += len;
+	read_buffer[pos] = 0;
 }
 
-unsigned char _read_char(int tty_fd, int &bread, int &read_error)
+// drop the first n bytes of the buffer
+void VEDirectPort::discard(unsigned int n, bool lost)
 {
-	unsigned char c = 0;
-	bread = read(tty_fd, &c, 1);
-	read_error = errno;
-	return c;
+	if (n == 0)
+		return;
+	if (lost)
+	{
+		m_bytes_lost.inc(n);
+		bytes_lost_stats += n;
+		synced = false;
+	}
+	memmove(read_buffer, read_buffer + n, pos - n);
+	pos -= n;
+	read_buffer[pos] = 0;
 }
-#endif
 
-static const char *end_string = "Checksum\t";
+// the buffer holds the CR LF that opens a frame
+void VEDirectPort::start_frame()
+{
+	phase = PHASE_FRAME;
+	last_start_line = pos;
+	tab_pos = -1;
+	n_fields = 0;
+	label_mask = 0;
+}
 
-VEDirectPort::~VEDirectPort()
+// the frame is malformed: drop it and look for the next line start,
+// keeping the last "keep" bytes that may be part of it
+void VEDirectPort::lose_sync(const char *reason, unsigned int keep)
 {
-	delete port;
+	m_resyncs.inc();
+	resyncs_stats++;
+	Log::trace("Lost sync on {%s} {%s} {%u bytes dropped}\n", port, reason, pos - keep);
+	discard(pos - keep, true);
+	phase = PHASE_IDLE;
+	synced = false;
 }
 
-void VEDirectPort::set_handler(int (*fun)(const char *))
+// a label repeated: the end of the frame was missed and this line starts the next one
+void VEDirectPort::restart_frame()
 {
-	VEDirectPort::fun = fun;
+	m_resyncs.inc();
+	resyncs_stats++;
+	Log::trace("Lost sync on {%s} {repeated label} {%u bytes dropped}\n", port, last_start_line - 2);
+	discard(last_start_line - 2, true);
+	start_frame();
+	last_start_line = 2;
 }
 
-static int check_end_frame(char *buffer, int pos)
+// a TAB has just been appended
+void VEDirectPort::end_label()
 {
-	int l = strlen(end_string) + 1; //+1 to account for the checksum character
-	if (pos < l)
-		return 0;
-	else
+	if (phase != PHASE_FRAME)
+		return; // not in a frame, e.g. a hex message
+	if (tab_pos >= 0)
+		return lose_sync("tab in value", 0);
+	int len = pos - 1 - last_start_line;
+	if (len == 0 || len > PORT_MAX_LABEL)
+		return lose_sync("bad label", 0);
+	for (int i = 0; i < len; i++)
+		if (!is_label_char(read_buffer[last_start_line + i]))
+			return lose_sync("bad label", 0);
+	if (len == END_STRING_LEN - 1 && memcmp(read_buffer + last_start_line, end_string, len) == 0)
+	{
+		phase = PHASE_CHECKSUM;
+		return;
+	}
+
+	unsigned int h = 0;
+	for (int i = 0; i < len; i++)
+		h = h * 31 + (unsigned char)read_buffer[last_start_line + i];
+	uint64_t bit = (uint64_t)1 << (h & 63);
+	if (label_mask & bit)
 	{
-		char *xx = buffer + sizeof(char) * (pos - l);
-		for (int x = 0; x < strlen(end_string); x++)
+		for (unsigned int i = 0; i < n_fields; i++)
 		{
-			if (xx[x] != end_string[x])
-				return 0;
+			if (field_len[i] == len && memcmp(read_buffer + field_start[i], read_buffer + last_start_line, len) == 0)
+			{
+				restart_frame();
+				break;
+			}
 		}
-		// printf("Matched '%s'\n", xx);
-		return -1;
 	}
+	if (n_fields == PORT_MAX_FIELDS)
+		return lose_sync("too many fields", 0);
+	field_start[n_fields] = last_start_line;
+	field_len[n_fields] = len;
+	n_fields++;
+	label_mask |= bit;
+	tab_pos = pos - 1;
 }
 
-static int check_start(char *buffer, int pos)
+// the reason why the line just ended does not fit the grammar, NULL if it does
+const char *VEDirectPort::check_line()
 {
-	if (pos < 2)
-		return 0;
-	else
-		return (buffer[pos - 1] == 10 && buffer[pos - 2] == 13);
+	if (read_buffer[pos - 2] != 13)
+		return "LF without CR";
+	if (tab_pos < 0)
+		return "missing tab";
+	int len = pos - 2 - (tab_pos + 1);
+	if (len > PORT_MAX_VALUE)
+		return "value too long";
+	for (int i = 0; i < len; i++)
+		if (!is_value_char(read_buffer[tab_pos + 1 + i]))
+			return "bad value";
+	return NULL;
 }
 
-void VEDirectPort::reset()
+// a LF has just been appended
+void VEDirectPort::end_line()
 {
-	read_buffer[0] = 0;
-	pos = 0;
-	last_start_line = 0;
-	checksum = 0;
-	phase = PHASE_IDLE;
+	if (phase == PHASE_FRAME)
+	{
+		const char *reason = check_line();
+		if (reason == NULL)
+		{
+			if (pos - 2 - (tab_pos + 1) == 1 && near_checksum(read_buffer + last_start_line, tab_pos - last_start_line))
+			{
+				// a damaged "Checksum" line: that frame is lost but the next one starts here
+				m_checksum_failures.inc();
+				m_resyncs.inc();
+				resyncs_stats++;
+				Log::trace("Lost sync on {%s} {damaged checksum} {%u bytes dropped}\n", port, pos - 2);
+				discard(pos - 2, true);
+				synced = true;
+				start_frame();
+				return;
+			}
+			// handed over once the checksum is known to be right
+			field_end[n_fields - 1] = pos - 2;
+			last_start_line = pos;
+			tab_pos = -1;
+			return;
+		}
+		lose_sync(reason, 2); // the CR LF may still open the next line
+	}
+	// looking for a frame: the first CR LF starts it, hex messages (':' to LF) are skipped
+	bool hex = read_buffer[0] == ':';
+	if (pos >= 2 && read_buffer[pos - 2] == 13)
+	{
+		discard(pos - 2, !hex);
+		start_frame();
+	}
+	else
+	{
+		discard(pos, !hex);
+	}
 }
 
-int VEDirectPort::process_char(unsigned char c)
+// the checksum byte has just been appended
+void VEDirectPort::end_frame()
 {
-	read_buffer[pos] = c;
-	checksum = (checksum + c) & 0xFF;
-	read_buffer[pos + 1] = 0;
-	pos++;
-	if (pos == PORT_BUFFER_SIZE)
+	// the bytes since the CR LF opening the frame add up to 0 in a valid frame
+	if (byte_sum((const unsigned char *)read_buffer, pos) == 0)
 	{
-		// avoid overruning buffer
-		Log::trace("Buffer full\n");
-		reset();
+		m_frames.inc();
+#ifndef ESP32_ARCH
+		// the buffer holds the whole frame, from the CR LF opening it to the checksum byte
+		if (rebroadcast && rebroadcast_frames)
+			rebroadcast->write((const unsigned char *)read_buffer, pos);
+#endif
+		// hand the lines over in place, without the CR LF
+		for (unsigned int i = 0; i < n_fields; i++)
+		{
+			read_buffer[field_end[i]] = 0;
+			(*fun)(read_buffer + field_start[i], fun_ctx);
+			read_buffer[field_end[i]] = 13;
+		}
+		(*fun)(end_string, fun_ctx);
 	}
-	if (phase == PHASE_IDLE && check_start(read_buffer, pos))
+	else
 	{
-		// printf("Started frame\n");
-		phase = PHASE_FRAME;
-		last_start_line = pos;
+		m_checksum_failures.inc();
+		m_bytes_lost.inc(pos);
+		bytes_lost_stats += pos;
+		// a frame picked up halfway is expected to fail
+		if (synced)
+			Log::trace("Invalid frame {%s} {%u bytes}\n", escape(read_buffer, pos), pos);
 	}
-	else if (phase == PHASE_FRAME && check_start(read_buffer, pos))
+	reset();
+	synced = true;
+}
+
+// no delimiter for too long: the line cannot be part of a frame
+void VEDirectPort::check_line_length()
+{
+	if (phase == PHASE_FRAME && pos - last_start_line > PORT_MAX_LINE)
+		lose_sync("line too long", 1); // the last byte may be the CR of the next line
+	else if (phase == PHASE_IDLE && pos > PORT_MAX_LINE)
+		discard(pos - 1, read_buffer[0] != ':');
+}
+
+void VEDirectPort::process_block(const unsigned char *data, int len)
+{
+	unsigned short delimiters[PORT_READ_CHUNK];
+	int n = scan_delimiters(data, len, delimiters);
+	int done = 0;
+	if (phase == PHASE_CHECKSUM && len)
 	{
-		static char temp[128];
-		memcpy(temp, read_buffer + last_start_line * sizeof(char), (pos - last_start_line) * sizeof(char));
-		temp[pos - last_start_line - 2] = 0;
-		last_start_line = pos;
-		(*fun)(temp);
+		append(data, 1);
+		end_frame();
+		done = 1;
 	}
-	else if (phase == PHASE_FRAME && check_end_frame(read_buffer, pos))
+	for (int k = 0; k < n; k++)
 	{
-		// frame complete
-		if (checksum == 0)
-		{
-			(*fun)("Checksum\t");
-		}
+		int end = delimiters[k] + 1;
+		if (end <= done)
+			continue; // consumed as a checksum byte
+		append(data + done, end - done);
+		done = end;
+		if (data[end - 1] == '\n')
+			end_line();
 		else
+			end_label();
+		if (phase == PHASE_CHECKSUM && done < len)
 		{
-			Log::trace("Invalid frame {%s}\n", read_buffer);
+			append(data + done, 1);
+			end_frame();
+			done++;
 		}
-		// printf("Read frame '%s' %d\n", read_buffer, checksum);
-		reset();
-		return 1;
 	}
-	return 0;
+	append(data + done, len - done);
+	check_line_length();
 }
 
 void VEDirectPort::set_port(const char *port_name)
 {
-	delete port;
-	port = strdup(port_name);
+	strncpy(port, port_name, PORT_NAME_SIZE - 1);
+	port[PORT_NAME_SIZE - 1] = 0;
+}
+
+void VEDirectPort::attach(Scheduler &_scheduler)
+{
+	scheduler = &_scheduler;
+	open_timer.set_callback(on_open_timer, this);
+	stats_timer.set_callback(on_stats_timer, this);
+	scheduler->schedule(open_timer, 0);
+	scheduler->schedule(stats_timer, PORT_STATS_PERIOD, PORT_STATS_PERIOD);
+#ifndef ESP32_ARCH
+	if (rebroadcast)
+		rebroadcast->attach(_scheduler); // the clients are served from the thread reading the port
+#endif
+}
+
+void VEDirectPort::schedule_open(unsigned long delay)
+{
+	if (scheduler)
+		scheduler->schedule(open_timer, delay);
+}
+
+void VEDirectPort::on_open_timer(void *ctx)
+{
+	((VEDirectPort *)ctx)->try_open();
+}
+
+void VEDirectPort::on_stats_timer(void *ctx)
+{
+	((VEDirectPort *)ctx)->dump_stats();
+}
+
+void VEDirectPort::dump_stats()
+{
+	unsigned long t0 = _millis();
+	Log::trace("[Stats] %d Bytes read in the last %dms from {%s} {%lu resyncs} {%lu bytes lost}\n",
+			   bytes_read_stats, t0 - last_stats, port, resyncs_stats, bytes_lost_stats);
+	last_stats = t0;
+	bytes_read_stats = 0;
+	resyncs_stats = 0;
+	bytes_lost_stats = 0;
+}
+
+void VEDirectPort::feed(const unsigned char *data, int len)
+{
+	bytes_read_stats += len;
+	m_bytes.inc(len);
+#ifndef ESP32_ARCH
+	if (rebroadcast && !rebroadcast_frames)
+		rebroadcast->write(data, len);
+#endif
+	// the delimiter positions of a block are kept on the stack
+	for (int i = 0; i < len; i += PORT_READ_CHUNK)
+	{
+		process_block(data + i, (len - i) < PORT_READ_CHUNK ? (len - i) : PORT_READ_CHUNK);
+	}
 }
 
-void VEDirectPort::try_open(unsigned long t0, unsigned long timeout)
+template <class Transport>
+void VEDirectPortT<Transport>::try_open()
 {
-	while (tty_fd <= 0 && (_millis() - t0) < timeout)
+	if (transport.is_open())
+		return;
+	m_reopen.inc();
+	if (transport.open(port, speed))
 	{
-		if (open())
-		{
-			reset();
-		}
-		else
-		{
-			// add an extra pause of 1sec
-			msleep(1000);
-		}
+		reset();
+	}
+	else
+	{
+		// retry later without holding up the main loop
+		schedule_open(PORT_REOPEN_PERIOD);
 	}
 }
 
-int VEDirectPort::check_speed_reset()
+template <class Transport>
+int VEDirectPortT<Transport>::check_speed_reset()
 {
-	if (last_speed != speed && tty_fd > 0)
+	if (last_speed != speed && transport.is_open())
 	{
 		Log::trace("Speed has changed {%d->%d} - reset\n", last_speed, speed);
 		close();
@@ -262,52 +460,75 @@ int VEDirectPort::check_speed_reset()
 	return 0;
 }
 
-void VEDirectPort::dump_stats(unsigned long t0, unsigned long period)
-{
-	if ((t0 - last_stats) >= period)
-	{
-		Log::trace("[Stats] %d Bytes read in the last %dms from device handle %d\n", bytes_read_stats, period, tty_fd);
-		last_stats = t0;
-		bytes_read_stats = 0;
-	}
-}
-
-void VEDirectPort::listen(uint ms)
+template <class Transport>
+void VEDirectPortT<Transport>::listen(unsigned int ms)
 {
 	unsigned long t0 = _millis();
 
-	check_speed_reset();
-	try_open(t0, ms);
-	dump_stats(t0, 10000);
+	if (check_speed_reset())
+		schedule_open(0);
 
-	if (tty_fd > 0)
+	if (transport.is_open())
 	{
+		TRACE_SCOPE("vedirect.listen");
+		unsigned char buffer[PORT_READ_CHUNK];
 		while ((_millis() - t0) <= ms) // go back to the main loop after ms
 		{
-			int bread = 0;
-			int read_error = 0;
-			unsigned char c = _read_char(tty_fd, bread, read_error);
+			int bread = transport.read(buffer, sizeof(buffer));
 
 			if (bread > 0)
 			{
-				bytes_read_stats += bread;
-				process_char(c);
+				if (capture)
+					capture->write(buffer, bread, _micros());
+				feed(buffer, bread);
+			}
+			else if (bread == TRANSPORT_AGAIN)
+			{
+				// nothing to read
+				return;
 			}
 			else
 			{
-				if (read_error == NOTHING_TO_READ_ERROR)
-				{
-					// nothing to read
-					return;
-				}
+				if (bread == TRANSPORT_EOF)
+					Log::trace("End of data from {%s}\n", port);
 				else
-				{
-					// some other error occurred
-					Log::trace("Err reading port {%s} {%d} {%s}\n", port, read_error, strerror(read_error));
-					close();
-					return;
-				}
+					Log::trace("Err reading port {%s} {%d} {%s}\n", port, errno, strerror(errno));
+				close();
+				if (bread == TRANSPORT_ERROR || Transport::reopen_at_eof)
+					schedule_open(PORT_REOPEN_PERIOD);
+				return;
 			}
 		}
 	}
 }
+
+#ifdef ESP32_ARCH
+template class VEDirectPortT<Serial2Transport>;
+
+VEDirectPort *VEDirectPort::create(unsigned int rx, unsigned int tx, unsigned int speed)
+{
+	VEDirectPortT<Serial2Transport> *p = new VEDirectPortT<Serial2Transport>("Serial2", speed);
+	p->get_transport().set_pins(rx, tx);
+	return p;
+}
+#else
+template class VEDirectPortT<TtyTransport>;
+template class VEDirectPortT<TcpTransport>;
+template class VEDirectPortT<UnixTransport>;
+template class VEDirectPortT<FileTransport>;
+
+VEDirectPort *VEDirectPort::create(const char *address, unsigned int speed)
+{
+	if (strncmp(address, "tcp:", 4) == 0)
+	{
+		VEDirectPortT<TcpTransport> *p = new VEDirectPortT<TcpTransport>(address + 4, speed);
+		p->get_transport().resolve(address + 4); // during setup, the reconnections reuse it
+		return p;
+	}
+	if (strncmp(address, "unix:", 5) == 0)
+		return new VEDirectPortT<UnixTransport>(address + 5, speed);
+	if (strncmp(address, "file:", 5) == 0)
+		return new VEDirectPortT<FileTransport>(address + 5, speed);
+	return new VEDirectPortT<TtyTransport>(address, speed);
+}
+#endif
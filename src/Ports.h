@@ -17,27 +17,52 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 #define PORTS_H_
 
 #include <stdlib.h>
+#include <stdint.h>
+#include "Scheduler.h"
+#include "Capture.h"
+#include "Transport.h"
 
-#define PORT_BUFFER_SIZE 8192
+class RebroadcastServer;
 
-#define PHASE_IDLE 0
+#define PORT_BUFFER_SIZE 8192
+#define PORT_READ_CHUNK 256
+#define PORT_REOPEN_PERIOD 1000
+#define PORT_STATS_PERIOD 10000
+#define PORT_NAME_SIZE 64
+
+// framing limits: a frame is CR LF <label> TAB <value> repeated, ending with "Checksum" TAB <byte>
+// anything outside them means a byte was lost and the framer looks for the next line start
+#define PORT_MAX_LABEL 16
+#define PORT_MAX_VALUE 64
+#define PORT_MAX_LINE (PORT_MAX_LABEL + PORT_MAX_VALUE + 2)
+#define PORT_MAX_FIELDS 32
+#define PORT_TRACE_BYTES 48 // of an invalid frame
+
+#define PHASE_IDLE 0     // looking for the CR LF that starts a frame
 #define PHASE_FRAME 1
+#define PHASE_CHECKSUM 2 // "Checksum\t" seen, the next byte ends the frame
 
+// framing of the ve.direct text protocol and the jobs common to all the transports;
+// the reads are in VEDirectPortT<Transport>, one virtual call per listen(), none per byte
 class VEDirectPort {
 
 public:
-#ifdef ESP32_ARCH
-	VEDirectPort(unsigned int rx, unsigned int tx, unsigned int speed);
-#else
 	VEDirectPort(const char* port, unsigned int speed);
-#endif
 
 	virtual ~VEDirectPort();
 
-	void listen(unsigned int ms);
-	void close();
+	// read what is available, for at most ms
+	virtual void listen(unsigned int ms) = 0;
+	virtual void close() = 0;
+
+	// handle to wait on for incoming data (-1 if not available)
+	virtual int get_fd() const = 0;
+
+	// register the reopen and stats jobs with the main loop scheduler
+	void attach(Scheduler& scheduler);
 
-	void set_handler(int (*fun)(const char*));
+	// called with each line of a frame and then with "Checksum\t", only for frames with a valid checksum
+	void set_handler(int (*fun)(const char* line, void* ctx), void* ctx);
 
 	void debug(bool dbg=true) { trace = dbg; }
 
@@ -45,36 +70,103 @@ public:
 
 	void set_port(const char* port_name);
 
-private:
+	// record everything read from the port
+	void set_capture(CaptureWriter* writer) { capture = writer; }
 
-	int open();
-	void try_open(unsigned long t0, unsigned long timeout);
-	int process_char(unsigned char c);
-	int check_speed_reset();
-	void dump_stats(unsigned long t0, unsigned long period);
-	void reset();
+	// serve the bytes read, or only the frames with a valid checksum, to other processes
+	void set_rebroadcast(RebroadcastServer* server, bool frames_only) { rebroadcast = server; rebroadcast_frames = frames_only; }
 
-	int tty_fd = 0;
+	// push raw bytes through the framing/parsing path, as if read from the port
+	void feed(const unsigned char* data, int len);
 
-	char read_buffer[PORT_BUFFER_SIZE];
-	unsigned int pos = 0;
+#ifdef ESP32_ARCH
+	static VEDirectPort* create(unsigned int rx, unsigned int tx, unsigned int speed);
+#else
+	// "tcp:<host>:<port>", "unix:<path>", "file:<path>" or a tty device
+	static VEDirectPort* create(const char* address, unsigned int speed);
+#endif
+
+protected:
+	virtual void try_open() = 0;
+	void schedule_open(unsigned long delay);
+	void reset();
 
-	const char* port = NULL;
+	char port[PORT_NAME_SIZE];
 	unsigned int speed = 19200;
 	unsigned int last_speed = 0;
-	unsigned int rx = 15;
-	unsigned int tx = 19;
 
-	int (*fun)(const char*);
+	CaptureWriter* capture = NULL;
+	RebroadcastServer* rebroadcast = NULL;
+	bool rebroadcast_frames = false;
+
+private:
+	void process_block(const unsigned char* data, int len);
+	void append(const unsigned char* data, int len);
+	void end_label();
+	void end_line();
+	void end_frame();
+	const char* check_line();
+	void check_line_length();
+	void start_frame();
+	void restart_frame();
+	void lose_sync(const char* reason, unsigned int keep);
+	void discard(unsigned int n, bool lost);
+	void dump_stats();
+
+	static void on_open_timer(void* ctx);
+	static void on_stats_timer(void* ctx);
+
+	char read_buffer[PORT_BUFFER_SIZE];
+	unsigned int pos = 0;
+
+	int (*fun)(const char*, void*);
+	void* fun_ctx = NULL;
 
 	bool trace = false;
 
 	unsigned long last_stats;
 	unsigned long bytes_read_stats;
+	unsigned long resyncs_stats;
+	unsigned long bytes_lost_stats;
+
+	Scheduler* scheduler = NULL;
+	SchedulerTimer open_timer;
+	SchedulerTimer stats_timer;
 
-	unsigned int checksum;
 	unsigned char phase;
 	unsigned int last_start_line = 0;
+	int tab_pos = -1;     // of the current line, -1 until its label is complete
+	bool synced = false;  // the current frame started right after the previous one
+
+	// lines of the current frame, a repeated label means its end was missed
+	unsigned short field_start[PORT_MAX_FIELDS];
+	unsigned short field_end[PORT_MAX_FIELDS];
+	unsigned char field_len[PORT_MAX_FIELDS]; // of the label
+	unsigned int n_fields = 0;
+	uint64_t label_mask = 0;
+};
+
+template <class Transport>
+class VEDirectPortT : public VEDirectPort {
+
+public:
+	VEDirectPortT(const char* port, unsigned int speed) : VEDirectPort(port, speed) {}
+
+	virtual ~VEDirectPortT() { close(); }
+
+	void listen(unsigned int ms);
+	void close() { transport.close(); }
+	int get_fd() const { return transport.get_fd(); }
+
+	Transport& get_transport() { return transport; }
+
+protected:
+	void try_open();
+
+private:
+	int check_speed_reset();
+
+	Transport transport;
 };
 
 #endif // PORTS_H_
@@ -0,0 +1,108 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESP32_ARCH
+
+#include "Realtime.h"
+#include "Log.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+bool Realtime::lock_memory()
+{
+#ifdef __GLIBC__
+    // freed memory stays in the heap instead of being unmapped and faulted in again
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+    // MCL_CURRENT also faults in the static buffers reserved at setup
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        Log::trace("Err locking memory {%d} {%s}, needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK\n", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool Realtime::set_fifo(int priority)
+{
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (res != 0)
+    {
+        Log::trace("Err setting SCHED_FIFO {%d} {%d} {%s}, needs CAP_SYS_NICE or RLIMIT_RTPRIO\n", priority, res, strerror(res));
+        return false;
+    }
+    return true;
+}
+
+__attribute__((noinline)) void Realtime::prefault_stack()
+{
+    volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+    for (unsigned int i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+void Realtime::apply_thread(const char *name, int priority)
+{
+    prefault_stack();
+    if (set_fifo(priority))
+        Log::trace("Thread {%s} running SCHED_FIFO {%d}\n", name, priority);
+}
+
+static long elapsed_us(const struct timespec &a, const struct timespec &b)
+{
+    return (b.tv_sec - a.tv_sec) * 1000000L + (b.tv_nsec - a.tv_nsec) / 1000;
+}
+
+void Realtime::self_check()
+{
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+
+    long max_us = 0;
+    long sum_us = 0;
+    struct timespec t0, t1;
+    struct timespec period = {0, 1000000};
+    for (int i = 0; i < REALTIME_CHECK_SAMPLES; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &period, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        long late = elapsed_us(t0, t1) - 1000;
+        if (late > max_us)
+            max_us = late;
+        sum_us += late;
+    }
+    getrusage(RUSAGE_SELF, &after);
+
+    int policy;
+    struct sched_param param;
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    Log::trace("Realtime check: policy {%s %d} page faults {%ld minor} {%ld major} {%ld during the check} wakeup latency {mean %ldus} {max %ldus}\n",
+               policy == SCHED_FIFO ? "FIFO" : "OTHER", param.sched_priority,
+               after.ru_minflt, after.ru_majflt, (after.ru_minflt + after.ru_majflt) - (before.ru_minflt + before.ru_majflt),
+               sum_us / REALTIME_CHECK_SAMPLES, max_us);
+}
+
+#endif
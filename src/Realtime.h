@@ -0,0 +1,46 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#ifndef ESP32_ARCH
+
+#define REALTIME_STACK_PREFAULT (256 * 1024) // bytes of stack made resident per thread
+#define REALTIME_CHECK_SAMPLES 200           // 1ms sleeps timed by the self-check
+
+// real-time profile for the Linux build: every step logs and carries on when not permitted
+class Realtime
+{
+public:
+    // lock all the memory, current and future, and keep the heap from giving pages back
+    static bool lock_memory();
+
+    // SCHED_FIFO at "priority" (1..99) for the calling thread
+    static bool set_fifo(int priority);
+
+    // make the first REALTIME_STACK_PREFAULT bytes of the calling thread stack resident
+    static void prefault_stack();
+
+    // the profile for the calling thread: prefaulted stack and SCHED_FIFO
+    static void apply_thread(const char *name, int priority);
+
+    // log the page faults so far and the wakeup latency of short sleeps
+    static void self_check();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESP32_ARCH
+
+#include "Rebroadcast.h"
+#include "Log.h"
+#include "Metrics.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+static MetricGauge m_clients("vedirect_rebroadcast_clients", "Clients connected to the ve.direct rebroadcast servers");
+static MetricCounter m_bytes("vedirect_rebroadcast_bytes_total", "Bytes sent to the ve.direct rebroadcast clients");
+static MetricCounter m_dropped("vedirect_rebroadcast_clients_dropped_total", "ve.direct rebroadcast clients disconnected, gone or too far behind");
+static int total_clients = 0; // all the servers, for the gauge
+
+#define RING_MASK (REBROADCAST_RING_SIZE - 1)
+
+RebroadcastServer::RebroadcastServer() : fd(-1), head(0), n_clients(0), poll_timer(on_poll_timer, this)
+{
+    unix_path[0] = 0;
+    for (int i = 0; i < REBROADCAST_MAX_CLIENTS; i++)
+        clients[i] = -1;
+}
+
+RebroadcastServer::~RebroadcastServer()
+{
+    close();
+}
+
+bool RebroadcastServer::open(const char *address)
+{
+    if (strncmp(address, "unix:", 5) == 0)
+        return open_unix(address + 5);
+    int port = atoi(address);
+    if (port <= 0 || port > 65535)
+    {
+        Log::trace("Err bad rebroadcast address {%s}, expected <port> or unix:<path>\n", address);
+        return false;
+    }
+    return open_tcp(port);
+}
+
+bool RebroadcastServer::open_tcp(int port)
+{
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        Log::trace("Err creating rebroadcast socket {%d} {%s}\n", errno, strerror(errno));
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        Log::trace("Err opening rebroadcast TCP port {%d} {%d} {%s}\n", port, errno, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    Log::trace("Rebroadcasting ve.direct on TCP port {%d}\n", port);
+    return true;
+}
+
+bool RebroadcastServer::open_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        Log::trace("Err rebroadcast socket path too long {%s}\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        Log::trace("Err creating rebroadcast socket {%d} {%s}\n", errno, strerror(errno));
+        return false;
+    }
+    unlink(path); // left over by a previous run
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        Log::trace("Err opening rebroadcast socket {%s} {%d} {%s}\n", path, errno, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    strcpy(unix_path, path);
+    Log::trace("Rebroadcasting ve.direct on {%s}\n", path);
+    return true;
+}
+
+void RebroadcastServer::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    if (unix_path[0])
+        unlink(unix_path);
+    unix_path[0] = 0;
+    for (int i = 0; i < REBROADCAST_MAX_CLIENTS; i++)
+    {
+        if (clients[i] >= 0)
+        {
+            ::close(clients[i]);
+            clients[i] = -1;
+            total_clients--;
+        }
+    }
+    n_clients = 0;
+    m_clients.set(total_clients);
+}
+
+void RebroadcastServer::attach(Scheduler &scheduler)
+{
+    scheduler.schedule(poll_timer, 0, REBROADCAST_POLL_PERIOD);
+}
+
+void RebroadcastServer::on_poll_timer(void *ctx)
+{
+    RebroadcastServer *s = (RebroadcastServer *)ctx;
+    s->accept_clients();
+    s->pump();
+}
+
+void RebroadcastServer::accept_clients()
+{
+    if (fd < 0)
+        return;
+    int c;
+    while ((c = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        int i = 0;
+        while (i < REBROADCAST_MAX_CLIENTS && clients[i] >= 0)
+            i++;
+        if (i == REBROADCAST_MAX_CLIENTS)
+        {
+            Log::trace("Too many rebroadcast clients, refusing connection\n");
+            ::close(c);
+            continue;
+        }
+        // from now on, not from what the ring still holds
+        clients[i] = c;
+        cursors[i] = head;
+        n_clients++;
+        total_clients++;
+        m_clients.set(total_clients);
+    }
+}
+
+void RebroadcastServer::drop_client(int i, const char *reason)
+{
+    Log::trace("Rebroadcast client dropped {%s}\n", reason);
+    ::close(clients[i]);
+    clients[i] = -1;
+    n_clients--;
+    total_clients--;
+    m_clients.set(total_clients);
+    m_dropped.inc();
+}
+
+void RebroadcastServer::write(const unsigned char *data, int len)
+{
+    if (fd < 0 || len <= 0)
+        return;
+    // only the last REBROADCAST_RING_SIZE bytes can be read anyway
+    if (len > REBROADCAST_RING_SIZE)
+    {
+        head += len - REBROADCAST_RING_SIZE;
+        data += len - REBROADCAST_RING_SIZE;
+        len = REBROADCAST_RING_SIZE;
+    }
+    unsigned int start = head & RING_MASK;
+    unsigned int first = REBROADCAST_RING_SIZE - start;
+    if (first > (unsigned int)len)
+        first = len;
+    memcpy(ring + start, data, first);
+    memcpy(ring, data + first, len - first);
+    head += len;
+    if (n_clients)
+        pump();
+}
+
+void RebroadcastServer::pump()
+{
+    for (int i = 0; i < REBROADCAST_MAX_CLIENTS; i++)
+    {
+        if (clients[i] < 0 || cursors[i] == head)
+            continue;
+        if (head - cursors[i] > REBROADCAST_RING_SIZE)
+        {
+            drop_client(i, "too far behind");
+            continue;
+        }
+        // straight from the ring, in two pieces when it wraps
+        unsigned int start = cursors[i] & RING_MASK;
+        unsigned int pending = head - cursors[i];
+        struct iovec iov[2];
+        iov[0].iov_base = ring + start;
+        iov[0].iov_len = (start + pending > REBROADCAST_RING_SIZE) ? REBROADCAST_RING_SIZE - start : pending;
+        iov[1].iov_base = ring;
+        iov[1].iov_len = pending - iov[0].iov_len;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+        ssize_t w = sendmsg(clients[i], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w > 0)
+        {
+            cursors[i] += w;
+            m_bytes.inc(w);
+        }
+        else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            drop_client(i, strerror(errno));
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REBROADCAST_H
+#define REBROADCAST_H
+
+#ifndef ESP32_ARCH
+
+#include <stdint.h>
+#include "Scheduler.h"
+
+#define REBROADCAST_RING_SIZE 65536 // bytes, ~30s of ve.direct at 19200 baud; a power of 2
+#define REBROADCAST_MAX_CLIENTS 8
+#define REBROADCAST_POLL_PERIOD 100 // ms between accepts and retries of stalled clients
+
+// the bytes of a ve.direct port (raw, or only the frames with a valid checksum)
+// served to any number of TCP or Unix socket clients, so that other tools can
+// share the port. The data is copied once into a ring, each client only has a
+// cursor into it; a client that falls more than the ring behind is dropped.
+// Runs on the thread that reads the port.
+class RebroadcastServer
+{
+public:
+    RebroadcastServer();
+    ~RebroadcastServer();
+
+    // a TCP port number or "unix:<path>"
+    bool open(const char *address);
+    void close();
+
+    // accept the clients and retry the stalled ones from this scheduler
+    void attach(Scheduler &scheduler);
+
+    // append to the ring and send it out
+    void write(const unsigned char *data, int len);
+
+    int get_clients() const { return n_clients; }
+
+private:
+    bool open_tcp(int port);
+    bool open_unix(const char *path);
+    void accept_clients();
+    void pump();
+    void drop_client(int i, const char *reason);
+    static void on_poll_timer(void *ctx);
+
+    int fd;
+    char unix_path[108];
+    unsigned char ring[REBROADCAST_RING_SIZE];
+    uint64_t head; // bytes written since the start, the ring holds the last REBROADCAST_RING_SIZE
+    int clients[REBROADCAST_MAX_CLIENTS];
+    uint64_t cursors[REBROADCAST_MAX_CLIENTS];
+    int n_clients;
+    SchedulerTimer poll_timer;
+};
+
+#endif
+
+#endif
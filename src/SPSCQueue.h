@@ -0,0 +1,66 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+
+// lock-free single producer/single consumer ring, SIZE must be a power of 2
+// (one slot is kept free to tell full from empty)
+template <typename T, unsigned int SIZE>
+class SPSCQueue
+{
+    static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "SPSCQueue size must be a power of 2");
+
+public:
+    SPSCQueue() : head(0), tail(0) {}
+
+    // producer side, false if the queue is full
+    bool push(const T &item)
+    {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        unsigned int next = (h + 1) & (SIZE - 1);
+        if (next == tail.load(std::memory_order_acquire))
+            return false;
+        items[h] = item;
+        head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, false if the queue is empty
+    bool pop(T &item)
+    {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+        item = items[t];
+        tail.store((t + 1) & (SIZE - 1), std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+private:
+    T items[SIZE];
+    // keep producer and consumer indexes on separate cache lines
+    alignas(64) std::atomic<unsigned int> head;
+    alignas(64) std::atomic<unsigned int> tail;
+};
+
+#endif
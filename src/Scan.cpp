@@ -0,0 +1,122 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Scan.h"
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
+
+static int scan_delimiters_scalar(const unsigned char *data, int from, int len, unsigned short *positions, int n)
+{
+    for (int i = from; i < len; i++)
+    {
+        if (data[i] == '\t' || data[i] == '\n')
+            positions[n++] = i;
+    }
+    return n;
+}
+
+static unsigned int byte_sum_scalar(const unsigned char *data, int from, int len)
+{
+    unsigned int sum = 0;
+    for (int i = from; i < len; i++)
+        sum += data[i];
+    return sum;
+}
+
+#if defined(SCAN_SSE2)
+
+int scan_delimiters(const unsigned char *data, int len, unsigned short *positions)
+{
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    int n = 0;
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, lf)));
+        while (mask)
+        {
+            positions[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return scan_delimiters_scalar(data, i, len, positions, n);
+}
+
+unsigned char byte_sum(const unsigned char *data, int len)
+{
+    // psadbw against zero adds up 8 bytes into each 64 bits lane
+    __m128i acc = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(data + i)), zero));
+    unsigned int sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    return (sum + byte_sum_scalar(data, i, len)) & 0xFF;
+}
+
+#elif defined(SCAN_NEON)
+
+int scan_delimiters(const unsigned char *data, int len, unsigned short *positions)
+{
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    int n = 0;
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(data + i);
+        uint8x16_t m = vorrq_u8(vceqq_u8(v, tab), vceqq_u8(v, lf));
+        // narrow to 4 bits per byte, there is no movemask on NEON
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        while (mask)
+        {
+            positions[n++] = i + (__builtin_ctzll(mask) >> 2);
+            mask &= ~(0xFULL << (__builtin_ctzll(mask) & ~3));
+        }
+    }
+    return scan_delimiters_scalar(data, i, len, positions, n);
+}
+
+unsigned char byte_sum(const unsigned char *data, int len)
+{
+    uint32_t sum = 0;
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+        sum += vaddlvq_u8(vld1q_u8(data + i));
+    return (sum + byte_sum_scalar(data, i, len)) & 0xFF;
+}
+
+#else
+
+int scan_delimiters(const unsigned char *data, int len, unsigned short *positions)
+{
+    return scan_delimiters_scalar(data, 0, len, positions, 0);
+}
+
+unsigned char byte_sum(const unsigned char *data, int len)
+{
+    return byte_sum_scalar(data, 0, len) & 0xFF;
+}
+
+#endif
@@ -0,0 +1,28 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCAN_H
+#define SCAN_H
+
+// block kernels for the ve.direct framing, 16 bytes at a time with SSE2 or NEON,
+// one at a time elsewhere (e.g. ESP32)
+
+// offsets of every '\t' and '\n' in data, in order; positions must hold len entries
+int scan_delimiters(const unsigned char *data, int len, unsigned short *positions);
+
+// mod 256 sum of the bytes, i.e. the ve.direct checksum (0 for a valid frame)
+unsigned char byte_sum(const unsigned char *data, int len);
+
+#endif
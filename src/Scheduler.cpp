@@ -0,0 +1,214 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Scheduler.h"
+#include <string.h>
+
+#define FIRING_LEVEL 0xFF
+#define WHEEL_SPAN(level) (1UL << (WHEEL_BITS * (level)))
+
+static inline bool is_before(unsigned long a, unsigned long b)
+{
+    return (long)(a - b) < 0;
+}
+
+static inline int slot_index(unsigned long tick, int level)
+{
+    return (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+}
+
+// first occupied slot at or after "start", wrapping around the wheel
+static inline int first_occupied(uint64_t occupied, int start)
+{
+    uint64_t bits = start ? ((occupied >> start) | (occupied << (WHEEL_SIZE - start))) : occupied;
+    return (start + __builtin_ctzll(bits)) & WHEEL_MASK;
+}
+
+Scheduler::Scheduler() : firing(NULL), current(0), n_active(0)
+{
+    memset(slots, 0, sizeof(slots));
+    memset(occupied, 0, sizeof(occupied));
+}
+
+void Scheduler::start(unsigned long now)
+{
+    // as if run(now) had just been called
+    current = now + 1;
+}
+
+void Scheduler::insert(SchedulerTimer *t)
+{
+    unsigned long expires = is_before(t->deadline, current) ? current : t->deadline;
+    unsigned long delta = expires - current;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= WHEEL_SPAN(level + 1))
+        level++;
+    if (delta >= WHEEL_SPAN(WHEEL_LEVELS))
+    {
+        // beyond the wheel horizon: park it in the last slot, it will be re-cascaded
+        expires = current + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+    }
+    int index = slot_index(expires, level);
+
+    t->level = level;
+    t->index = index;
+    t->prev = NULL;
+    t->next = slots[level][index];
+    if (t->next)
+        t->next->prev = t;
+    slots[level][index] = t;
+    occupied[level] |= (1ULL << index);
+}
+
+void Scheduler::unlink(SchedulerTimer *t)
+{
+    SchedulerTimer **head = (t->level == FIRING_LEVEL) ? &firing : &slots[t->level][t->index];
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *head = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    if (*head == NULL && t->level != FIRING_LEVEL)
+        occupied[t->level] &= ~(1ULL << t->index);
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+void Scheduler::cascade(int level, int index)
+{
+    SchedulerTimer *t = slots[level][index];
+    slots[level][index] = NULL;
+    occupied[level] &= ~(1ULL << index);
+    while (t)
+    {
+        SchedulerTimer *next = t->next;
+        insert(t);
+        t = next;
+    }
+}
+
+void Scheduler::schedule(SchedulerTimer &t, unsigned long delay, unsigned long period)
+{
+    if (t.active)
+        cancel(t);
+    // "current - 1" is the tick run() processed last, a 0 delay fires on the next one
+    t.deadline = current - 1 + (delay ? delay : 1);
+    t.period = period;
+    t.active = true;
+    insert(&t);
+    n_active++;
+}
+
+void Scheduler::cancel(SchedulerTimer &t)
+{
+    if (t.active)
+    {
+        unlink(&t);
+        t.active = false;
+        n_active--;
+    }
+}
+
+int Scheduler::run(unsigned long now)
+{
+    int fired = 0;
+    while (!is_before(now, current))
+    {
+        if (n_active == 0)
+        {
+            current = now + 1;
+            break;
+        }
+
+        int index = current & WHEEL_MASK;
+        if (index == 0)
+        {
+            // level 0 wrapped: pull down the next block from the upper levels
+            for (int level = 1; level < WHEEL_LEVELS; level++)
+            {
+                int upper = slot_index(current, level);
+                cascade(level, upper);
+                if (upper)
+                    break;
+            }
+        }
+
+        // detach the slot, callbacks are free to re-arm or cancel anything
+        firing = slots[0][index];
+        slots[0][index] = NULL;
+        occupied[0] &= ~(1ULL << index);
+        for (SchedulerTimer *t = firing; t; t = t->next)
+            t->level = FIRING_LEVEL;
+        current++;
+
+        while (firing)
+        {
+            SchedulerTimer *t = firing;
+            unlink(t);
+            t->active = false;
+            n_active--;
+            if (t->period)
+            {
+                t->deadline += t->period;
+                if (is_before(t->deadline, current))
+                    t->deadline = current - 1 + t->period; // skip the periods we missed
+                t->active = true;
+                insert(t);
+                n_active++;
+            }
+            fired++;
+            if (t->fun)
+                t->fun(t->ctx);
+        }
+
+        // skip the empty ticks up to the next occupied slot or the next wrap
+        index = current & WHEEL_MASK;
+        if (index && !is_before(now, current))
+        {
+            uint64_t ahead = occupied[0] >> index;
+            unsigned long skip = ahead ? __builtin_ctzll(ahead) : (WHEEL_SIZE - index);
+            current = is_before(now, current + skip) ? now + 1 : current + skip;
+        }
+    }
+    return fired;
+}
+
+long Scheduler::next_timeout(unsigned long now, long max_wait)
+{
+    if (n_active == 0)
+        return max_wait;
+
+    unsigned long best = now + max_wait;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if (occupied[level] == 0)
+            continue;
+        // level 0 starts at the pending tick, upper levels at the block after the current
+        // one, unless "current" sits at the start of that block and run() has not
+        // cascaded it down yet
+        int start = slot_index(current, level);
+        if (level && (current & (WHEEL_SPAN(level) - 1)))
+            start = (start + 1) & WHEEL_MASK;
+        int index = first_occupied(occupied[level], start);
+        for (SchedulerTimer *t = slots[level][index]; t; t = t->next)
+        {
+            if (is_before(t->deadline, best))
+                best = t->deadline;
+        }
+    }
+    long wait = (long)(best - now);
+    return wait < 0 ? 0 : wait;
+}
@@ -0,0 +1,97 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// hierarchical timer wheel, 1 tick = 1ms
+// 4 levels of 64 slots cover ~4.6 hours, longer delays are clamped and re-cascaded
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+class Scheduler;
+
+class SchedulerTimer
+{
+public:
+    SchedulerTimer() : fun(NULL), ctx(NULL), deadline(0), period(0), next(NULL), prev(NULL), level(0), index(0), active(false) {}
+    SchedulerTimer(void (*_fun)(void *ctx), void *_ctx) : fun(_fun), ctx(_ctx), deadline(0), period(0), next(NULL), prev(NULL), level(0), index(0), active(false) {}
+
+    void set_callback(void (*_fun)(void *ctx), void *_ctx)
+    {
+        fun = _fun;
+        ctx = _ctx;
+    }
+
+    bool is_active() const { return active; }
+    unsigned long get_deadline() const { return deadline; }
+    unsigned long get_period() const { return period; }
+
+private:
+    friend class Scheduler;
+
+    void (*fun)(void *ctx);
+    void *ctx;
+    unsigned long deadline;
+    unsigned long period;
+    SchedulerTimer *next;
+    SchedulerTimer *prev;
+    unsigned char level;
+    unsigned char index;
+    bool active;
+};
+
+class Scheduler
+{
+public:
+    Scheduler();
+
+    // align the wheel to the current time, call once before scheduling anything
+    void start(unsigned long now);
+
+    // (re)arm a timer to fire after delay ms and then every period ms (0 = one shot)
+    // the delay is relative to the last time run() (or start()) was called
+    void schedule(SchedulerTimer &t, unsigned long delay, unsigned long period = 0);
+
+    // disarm a timer, no-op if not active
+    void cancel(SchedulerTimer &t);
+
+    // fire all timers expired at "now", returns the number of callbacks invoked
+    int run(unsigned long now);
+
+    // ms to wait from "now" before the next deadline, capped at max_wait
+    long next_timeout(unsigned long now, long max_wait);
+
+    unsigned int get_active() const { return n_active; }
+
+private:
+    void insert(SchedulerTimer *t);
+    void unlink(SchedulerTimer *t);
+    void cascade(int level, int index);
+
+    SchedulerTimer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t occupied[WHEEL_LEVELS];
+    SchedulerTimer *firing; // timers detached from the wheel and being fired
+
+    unsigned long current; // next tick to be processed
+    unsigned int n_active;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESP32_ARCH
+
+#include "SharedState.h"
+#include "Log.h"
+#include "Utils.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+SharedState::~SharedState()
+{
+    close();
+}
+
+bool SharedState::open(const char *_name, unsigned int n_devices)
+{
+    int fd = shm_open(_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(BatteryShmSegment)) < 0)
+    {
+        Log::trace("Err creating shared memory {%s} {%d} {%s}\n", _name, errno, strerror(errno));
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, sizeof(BatteryShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        Log::trace("Err mapping shared memory {%s} {%d} {%s}\n", _name, errno, strerror(errno));
+        return false;
+    }
+
+    shm = (BatteryShmSegment *)p;
+    // invalidate the header while the slots are cleared, readers check the magic
+    shm->magic = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < BATTERY_SHM_MAX_DEVICES; i++)
+    {
+        shm->slots[i].seq.store(0, std::memory_order_relaxed);
+        memset(&shm->slots[i].record, 0, sizeof(BatteryShmRecord));
+    }
+    shm->version = BATTERY_SHM_VERSION;
+    shm->record_size = sizeof(BatteryShmRecord);
+    shm->n_devices = (n_devices > BATTERY_SHM_MAX_DEVICES) ? BATTERY_SHM_MAX_DEVICES : n_devices;
+    std::atomic_thread_fence(std::memory_order_release);
+    shm->magic = BATTERY_SHM_MAGIC;
+    name = _name;
+    Log::trace("Publishing live state in shared memory {%s}\n", name);
+    return true;
+}
+
+void SharedState::close()
+{
+    if (shm)
+    {
+        munmap(shm, sizeof(BatteryShmSegment));
+        shm_unlink(name);
+    }
+    shm = NULL;
+}
+
+void SharedState::publish(unsigned int device, unsigned char instance, const BatteryReading &r)
+{
+    if (shm == NULL || device >= shm->n_devices)
+        return;
+    BatteryShmSlot &slot = shm->slots[device];
+    uint32_t s = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    BatteryShmRecord &rec = slot.record;
+    rec.frame = r.frame;
+    rec.time = _wall_millis();
+    rec.voltage = r.voltage;
+    rec.voltage1 = r.voltage1;
+    rec.current = r.current;
+    rec.soc = r.soc;
+    rec.temperature = r.temperature;
+    rec.ttg = r.ttg;
+    rec.consumed = r.consumed;
+    rec.alarm = r.alarm;
+    rec.relay = r.relay;
+    rec.alarm_reason = r.alarm_reason;
+    rec.instance = instance;
+
+    slot.seq.store(s + 2, std::memory_order_release);
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHARED_STATE_H
+#define SHARED_STATE_H
+
+#ifndef ESP32_ARCH
+
+#include "Battery.h"
+#include "BatteryShm.h"
+
+// writer side of the shared memory segment described in BatteryShm.h
+// each device slot must be published by one thread only
+class SharedState
+{
+public:
+    SharedState() : shm(NULL), name(NULL) {}
+    ~SharedState();
+
+    bool open(const char *name, unsigned int n_devices);
+    void close();
+
+    void publish(unsigned int device, unsigned char instance, const BatteryReading &r);
+
+    bool is_open() const { return shm != NULL; }
+
+private:
+    BatteryShmSegment *shm;
+    const char *name;
+};
+
+#endif
+
+#endif
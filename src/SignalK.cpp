@@ -0,0 +1,228 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESP32_ARCH
+
+#include "SignalK.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+static MetricCounter m_deltas("signalk_deltas_sent_total", "Signal K deltas sent");
+static MetricCounter m_dropped("signalk_dropped_clients_total", "Signal K TCP clients dropped because too slow");
+
+SignalKSink::SignalKSink() : udp_fd(-1), tcp_fd(-1), len(0), n_values(0), overflow(false), dropped_clients(0)
+{
+    memset(&udp_addr, 0, sizeof(udp_addr));
+    for (int i = 0; i < SIGNALK_MAX_CLIENTS; i++)
+        clients[i] = -1;
+}
+
+SignalKSink::~SignalKSink()
+{
+    close();
+}
+
+bool SignalKSink::open_udp(const char *target)
+{
+    char host[64];
+    const char *colon = strrchr(target, ':');
+    if (colon == NULL || (size_t)(colon - target) >= sizeof(host))
+    {
+        Log::trace("Invalid Signal K UDP target {%s}\n", target);
+        return false;
+    }
+    memcpy(host, target, colon - target);
+    host[colon - target] = 0;
+
+    udp_addr.sin_family = AF_INET;
+    udp_addr.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &udp_addr.sin_addr) != 1)
+    {
+        Log::trace("Invalid Signal K UDP address {%s}\n", host);
+        return false;
+    }
+    udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (udp_fd < 0)
+    {
+        Log::trace("Err creating Signal K UDP socket {%d} {%s}\n", errno, strerror(errno));
+        return false;
+    }
+    unsigned char ttl = 1; // multicast stays on the boat network
+    setsockopt(udp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    Log::trace("Sending Signal K deltas to {%s}\n", target);
+    return true;
+}
+
+bool SignalKSink::open_tcp(int port)
+{
+    tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (tcp_fd < 0)
+    {
+        Log::trace("Err creating Signal K TCP socket {%d} {%s}\n", errno, strerror(errno));
+        return false;
+    }
+    int one = 1;
+    setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(tcp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(tcp_fd, 4) < 0)
+    {
+        Log::trace("Err opening Signal K TCP port {%d} {%d} {%s}\n", port, errno, strerror(errno));
+        ::close(tcp_fd);
+        tcp_fd = -1;
+        return false;
+    }
+    Log::trace("Serving Signal K deltas on TCP port {%d}\n", port);
+    return true;
+}
+
+void SignalKSink::close()
+{
+    if (udp_fd >= 0)
+        ::close(udp_fd);
+    if (tcp_fd >= 0)
+        ::close(tcp_fd);
+    udp_fd = tcp_fd = -1;
+    for (int i = 0; i < SIGNALK_MAX_CLIENTS; i++)
+    {
+        if (clients[i] >= 0)
+            ::close(clients[i]);
+        clients[i] = -1;
+    }
+}
+
+void SignalKSink::poll()
+{
+    if (tcp_fd < 0)
+        return;
+    int c;
+    while ((c = accept4(tcp_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        int i = 0;
+        while (i < SIGNALK_MAX_CLIENTS && clients[i] >= 0)
+            i++;
+        if (i == SIGNALK_MAX_CLIENTS)
+        {
+            Log::trace("Too many Signal K clients, refusing connection\n");
+            ::close(c);
+        }
+        else
+        {
+            clients[i] = c;
+        }
+    }
+}
+
+void SignalKSink::drop_client(int i)
+{
+    ::close(clients[i]);
+    clients[i] = -1;
+    dropped_clients++;
+    m_dropped.inc();
+}
+
+void SignalKSink::add_value(unsigned char instance, const char *path, double value)
+{
+    if (value == N2kDoubleNA || overflow)
+        return;
+    int n = snprintf(buffer + len, sizeof(buffer) - len, "%s{\"path\":\"electrical.batteries.%d.%s\",\"value\":%g}",
+                     n_values ? "," : "", instance, path, value);
+    if (n < 0 || n >= (int)sizeof(buffer) - len)
+    {
+        overflow = true;
+        return;
+    }
+    len += n;
+    n_values++;
+}
+
+void SignalKSink::publish(const BatteryReading &r, const BatteryStats &stats, unsigned char instance, unsigned char instance_e)
+{
+    if (len == 0)
+    {
+        // open the delta, the values of all the batteries of the frame go in one update
+        char timestamp[32];
+        unsigned long long now = _wall_millis();
+        time_t t = now / 1000;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        int n = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(timestamp + n, sizeof(timestamp) - n, ".%03uZ", (unsigned int)(now % 1000));
+        len = snprintf(buffer, sizeof(buffer), "{\"updates\":[{\"source\":{\"label\":\"vedirectN2K\"},\"timestamp\":\"%s\",\"values\":[", timestamp);
+        n_values = 0;
+        overflow = false;
+    }
+    add_value(instance, "voltage", r.voltage);
+    add_value(instance, "current", r.current);
+    add_value(instance, "temperature", (r.temperature == N2kDoubleNA) ? N2kDoubleNA : r.temperature + 273.15);
+    add_value(instance, "capacity.stateOfCharge", (r.soc == N2kDoubleNA) ? N2kDoubleNA : r.soc / 100.0);
+    add_value(instance, "capacity.timeRemaining", (stats.ttg != N2kDoubleNA) ? stats.ttg : r.ttg);
+    add_value(instance, "capacity.dischargeSinceFull", (r.consumed == N2kDoubleNA) ? N2kDoubleNA : -r.consumed * 3600.0);
+    add_value(instance, "capacity.stateOfHealth", (stats.soh == N2kDoubleNA) ? N2kDoubleNA : stats.soh / 100.0);
+    add_value(instance_e, "voltage", r.voltage1);
+}
+
+void SignalKSink::flush()
+{
+    if (len == 0)
+        return;
+    const char *tail = "]}]}\n";
+    if (!overflow && n_values && len + (int)strlen(tail) < (int)sizeof(buffer))
+    {
+        strcpy(buffer + len, tail);
+        len += strlen(tail);
+        send_all();
+    }
+    else if (overflow)
+    {
+        Log::trace("Signal K delta too large, dropped\n");
+    }
+    len = 0;
+}
+
+void SignalKSink::send_all()
+{
+    if (udp_fd >= 0)
+    {
+        // non blocking, a full socket buffer just loses this delta
+        sendto(udp_fd, buffer, len, MSG_DONTWAIT, (struct sockaddr *)&udp_addr, sizeof(udp_addr));
+    }
+    for (int i = 0; i < SIGNALK_MAX_CLIENTS; i++)
+    {
+        if (clients[i] < 0)
+            continue;
+        ssize_t w = send(clients[i], buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w != len)
+        {
+            // gone, or not keeping up (a partial write would break the stream anyway)
+            drop_client(i);
+        }
+    }
+    m_deltas.inc();
+}
+
+#endif
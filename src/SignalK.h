@@ -0,0 +1,67 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIGNALK_H
+#define SIGNALK_H
+
+#include "OutputSink.h"
+
+#ifndef ESP32_ARCH
+#include <netinet/in.h>
+
+#define SIGNALK_BUFFER_SIZE 4096
+#define SIGNALK_MAX_CLIENTS 8
+
+// Signal K delta (electrical.batteries.*) over UDP (unicast or multicast) and
+// to TCP clients, one newline terminated delta per frame
+class SignalKSink : public OutputSink
+{
+public:
+    SignalKSink();
+    ~SignalKSink();
+
+    // "host:port", multicast groups are fine
+    bool open_udp(const char *target);
+    bool open_tcp(int port);
+    void close();
+
+    void publish(const BatteryReading &r, const BatteryStats &stats, unsigned char instance, unsigned char instance_e);
+    void flush();
+
+    void poll();
+    int get_fd() const { return tcp_fd; }
+
+    unsigned long get_dropped_clients() const { return dropped_clients; }
+
+private:
+    void add_value(unsigned char instance, const char *path, double value);
+    void send_all();
+    void drop_client(int i);
+
+    int udp_fd;
+    struct sockaddr_in udp_addr;
+    int tcp_fd;
+    int clients[SIGNALK_MAX_CLIENTS];
+
+    char buffer[SIGNALK_BUFFER_SIZE];
+    int len;
+    int n_values;
+    bool overflow;
+
+    unsigned long dropped_clients;
+};
+#endif
+
+#endif
@@ -0,0 +1,128 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Trace.h"
+
+#if VEDIRECT_TRACE
+
+#include "Log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdarg.h>
+
+#define TRACE_DUMP_BUFFER 65536
+
+static TraceRing rings[TRACE_MAX_THREADS];
+static std::atomic<int> n_rings(0);
+
+thread_local TraceRing *Trace::ring = NULL;
+
+TraceRing *Trace::claim()
+{
+    int i = n_rings.fetch_add(1);
+    if (i >= TRACE_MAX_THREADS)
+    {
+        n_rings.store(TRACE_MAX_THREADS);
+        return NULL;
+    }
+    ring = &rings[i];
+    return ring;
+}
+
+void Trace::set_thread_name(const char *name)
+{
+    TraceRing *r = ring ? ring : claim();
+    if (r)
+        r->thread_name = name;
+}
+
+// buffered writes straight to the fd, stdio would allocate its buffer
+struct TraceWriter
+{
+    int fd;
+    int len;
+    bool ok;
+    char buffer[TRACE_DUMP_BUFFER];
+
+    void flush()
+    {
+        if (len && write(fd, buffer, len) != len)
+            ok = false;
+        len = 0;
+    }
+
+    void append(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+void TraceWriter::append(const char *format, ...)
+{
+    if (TRACE_DUMP_BUFFER - len < 256)
+        flush();
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer + len, TRACE_DUMP_BUFFER - len, format, args);
+    va_end(args);
+    if (n > 0)
+        len += (n < TRACE_DUMP_BUFFER - len) ? n : TRACE_DUMP_BUFFER - len - 1;
+}
+
+bool Trace::dump(const char *path)
+{
+    static TraceWriter w; // too big for the stack
+    w.fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0)
+    {
+        Log::trace("Err opening trace dump {%s} {%d} {%s}\n", path, errno, strerror(errno));
+        return false;
+    }
+    w.len = 0;
+    w.ok = true;
+    unsigned long n_events = 0;
+    w.append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    int n = n_rings.load();
+    for (int i = 0; i < n; i++)
+    {
+        TraceRing &r = rings[i];
+        if (r.thread_name)
+        {
+            w.append("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                     first ? "" : ",\n", i, r.thread_name);
+            first = false;
+        }
+        uint32_t head = r.head.load(std::memory_order_acquire);
+        uint32_t from = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+        for (uint32_t h = from; h != head; h++)
+        {
+            const TraceEvent &e = r.events[h & (TRACE_RING_SIZE - 1)];
+            if (e.name == NULL)
+                continue;
+            w.append("%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%u}}",
+                     first ? "" : ",\n", e.name, e.phase, (unsigned long long)(e.ts / 1000), (unsigned long long)(e.ts % 1000), i, e.frame);
+            first = false;
+            n_events++;
+        }
+    }
+    w.append("\n]}\n");
+    w.flush();
+    ::close(w.fd);
+    Log::trace("Trace dumped to {%s} {%lu events} %s\n", path, n_events, w.ok ? "OK" : "KO");
+    return w.ok;
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// lightweight tracing spans: begin/end events go to a per-thread ring and are
+// dumped on request as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+// Every event is tagged with the frame the thread is working on (TRACE_FRAME).
+// Build with VEDIRECT_TRACE=0 to compile the macros out.
+#ifndef VEDIRECT_TRACE
+#ifdef ESP32_ARCH
+#define VEDIRECT_TRACE 0
+#else
+#define VEDIRECT_TRACE 1
+#endif
+#endif
+
+#define TRACE_RING_SIZE 16384 // events kept per thread, power of 2
+#define TRACE_MAX_THREADS 4
+
+#if VEDIRECT_TRACE
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+struct TraceEvent
+{
+    uint64_t ts; // ns, monotonic
+    const char *name; // must be a literal, only the pointer is stored
+    uint32_t frame;
+    char phase; // 'B' or 'E'
+};
+
+struct TraceRing
+{
+    TraceEvent events[TRACE_RING_SIZE];
+    std::atomic<uint32_t> head;
+    uint32_t frame;
+    const char *thread_name;
+};
+
+class Trace
+{
+public:
+    static inline void record(const char *name, char phase)
+    {
+        TraceRing *r = ring ? ring : claim();
+        if (r == NULL)
+            return; // more threads than rings
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        uint32_t h = r->head.load(std::memory_order_relaxed);
+        TraceEvent &e = r->events[h & (TRACE_RING_SIZE - 1)];
+        e.ts = (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+        e.name = name;
+        e.frame = r->frame;
+        e.phase = phase;
+        r->head.store(h + 1, std::memory_order_release);
+    }
+
+    static inline void set_frame(unsigned long frame)
+    {
+        TraceRing *r = ring ? ring : claim();
+        if (r)
+            r->frame = frame;
+    }
+
+    // label the calling thread in the dump
+    static void set_thread_name(const char *name);
+
+    // write the rings to a file, events being recorded meanwhile may be torn;
+    // uses no heap, so it is safe in the no-heap mode
+    static bool dump(const char *path);
+
+private:
+    static TraceRing *claim();
+    static thread_local TraceRing *ring;
+};
+
+class TraceScope
+{
+public:
+    TraceScope(const char *_name) : name(_name) { Trace::record(name, 'B'); }
+    ~TraceScope() { Trace::record(name, 'E'); }
+
+private:
+    const char *name;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_FRAME(frame) Trace::set_frame(frame)
+#define TRACE_BEGIN(name) Trace::record(name, 'B')
+#define TRACE_END(name) Trace::record(name, 'E')
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(_trace_scope_, __LINE__)(name)
+
+#else
+
+class Trace
+{
+public:
+    static void set_thread_name(const char *name) {}
+    static bool dump(const char *path) { return false; }
+};
+
+#define TRACE_FRAME(frame)
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_SCOPE(name)
+
+#endif
+
+#endif
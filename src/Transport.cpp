@@ -0,0 +1,217 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Transport.h"
+#include "Log.h"
+
+#ifdef ESP32_ARCH
+#include <Arduino.h>
+
+bool Serial2Transport::open(const char *address, unsigned int speed)
+{
+    Serial2.begin(speed, SERIAL_8N1, rx, tx);
+    opened = true;
+    return true;
+}
+
+void Serial2Transport::close()
+{
+    Serial2.end();
+    opened = false;
+}
+
+int Serial2Transport::read(unsigned char *buffer, int size)
+{
+    int n = 0;
+    while (n < size && Serial2.available())
+        buffer[n++] = (unsigned char)Serial2.read();
+    return n ? n : TRANSPORT_AGAIN;
+}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define TCP_KEEPALIVE_IDLE 10 // s of silence before probing a remote converter
+#define TCP_KEEPALIVE_INTERVAL 5
+#define TCP_KEEPALIVE_COUNT 3
+
+void FdTransport::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+int FdTransport::read(unsigned char *buffer, int size)
+{
+    int n = ::read(fd, buffer, size);
+    if (n > 0)
+        return n;
+    if (n == 0)
+        return TRANSPORT_EOF;
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOTCONN)
+        return TRANSPORT_AGAIN; // ENOTCONN: a socket still connecting
+    return TRANSPORT_ERROR;
+}
+
+// termios constant of a baud rate, B0 if not supported
+static speed_t tty_speed(unsigned int speed)
+{
+    switch (speed)
+    {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    default:
+        return B0;
+    }
+}
+
+bool TtyTransport::open(const char *address, unsigned int speed)
+{
+    struct termios tio;
+
+    memset(&tio, 0, sizeof(tio));
+    tio.c_iflag = 0;
+    tio.c_oflag = 0;
+    tio.c_cflag = CS8 | CREAD | CLOCAL; // 8n1, see termios.h for more information
+    tio.c_lflag = 0;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 5;
+
+    Log::trace("Opening port {%s}\n", address);
+
+    fd = ::open(address, O_RDONLY | O_NONBLOCK); // O_NONBLOCK might override VMIN and VTIME, so read() may return immediately.
+    if (fd < 0)
+    {
+        Log::trace("Err opening port {%s} {%d} {%s}\n", address, errno, strerror(errno));
+        return false;
+    }
+    speed_t baud = tty_speed(speed);
+    if (baud == B0)
+    {
+        Log::trace("Err unsupported speed {%u} on port {%s}, using 19200\n", speed, address);
+        baud = B19200;
+    }
+    cfsetospeed(&tio, baud);
+    cfsetispeed(&tio, baud);
+    if (tcsetattr(fd, TCSANOW, &tio) != 0)
+        Log::trace("Err setting up port {%s} {%d} {%s}\n", address, errno, strerror(errno));
+    return true;
+}
+
+bool TcpTransport::resolve(const char *address)
+{
+    char host[128];
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || colon == address || (size_t)(colon - address) >= sizeof(host))
+    {
+        Log::trace("Err bad TCP address {%s}, expected <host>:<port>\n", address);
+        return false;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = 0;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, colon + 1, &hints, &res);
+    if (err != 0)
+    {
+        Log::trace("Err resolving {%s} {%s}\n", address, gai_strerror(err));
+        return false;
+    }
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+bool TcpTransport::open(const char *address, unsigned int)
+{
+    // normally resolved at startup; a name not known yet then is looked up until it is
+    if (addr_len == 0 && !resolve(address))
+        return false;
+
+    Log::trace("Connecting to {%s}\n", address);
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd >= 0)
+    {
+        // a dead converter or cable otherwise goes unnoticed until the kernel gives up, hours later
+        int on = 1, idle = TCP_KEEPALIVE_IDLE, interval = TCP_KEEPALIVE_INTERVAL, count = TCP_KEEPALIVE_COUNT;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+        // completes in the background, a refused connection shows up as a read error
+        if (connect(fd, (struct sockaddr *)&addr, addr_len) != 0 && errno != EINPROGRESS)
+        {
+            Log::trace("Err connecting to {%s} {%d} {%s}\n", address, errno, strerror(errno));
+            close();
+        }
+    }
+    return fd >= 0;
+}
+
+bool UnixTransport::open(const char *address, unsigned int)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address, sizeof(addr.sun_path) - 1);
+
+    Log::trace("Connecting to {%s}\n", address);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        Log::trace("Err connecting to {%s} {%d} {%s}\n", address, errno, strerror(errno));
+        close();
+    }
+    return fd >= 0;
+}
+
+bool FileTransport::open(const char *address, unsigned int)
+{
+    fd = ::open(address, O_RDONLY);
+    if (fd < 0)
+    {
+        Log::trace("Err opening file {%s} {%d} {%s}\n", address, errno, strerror(errno));
+        return false;
+    }
+    Log::trace("Reading {%s}\n", address);
+    return true;
+}
+
+#endif
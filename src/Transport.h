@@ -0,0 +1,127 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+/*
+Byte sources for VEDirectPortT<Transport>. A transport provides:
+  bool open(const char *address, unsigned int speed);  false if not available (retried later)
+  void close();
+  int read(unsigned char *buffer, int size);  bytes read, or one of the TRANSPORT_ codes
+  int get_fd() const;                          handle to wait on, -1 if none
+  bool is_open() const;
+  static const bool reopen_at_eof;             the source comes back after an EOF
+*/
+
+#define TRANSPORT_AGAIN 0   // nothing to read now
+#define TRANSPORT_EOF -1    // the other end went away, or the end of a file
+#define TRANSPORT_ERROR -2  // errno tells why
+
+#ifdef ESP32_ARCH
+
+class Serial2Transport
+{
+public:
+    Serial2Transport() : rx(15), tx(19), opened(false) {}
+
+    void set_pins(unsigned int _rx, unsigned int _tx)
+    {
+        rx = _rx;
+        tx = _tx;
+    }
+
+    bool open(const char *address, unsigned int speed);
+    void close();
+    int read(unsigned char *buffer, int size);
+    int get_fd() const { return -1; } // Serial2 has no handle to wait on
+    bool is_open() const { return opened; }
+
+    static const bool reopen_at_eof = true;
+
+private:
+    unsigned int rx;
+    unsigned int tx;
+    bool opened;
+};
+
+#else
+
+#include <sys/socket.h>
+
+// common to the transports reading a file descriptor
+class FdTransport
+{
+public:
+    FdTransport() : fd(-1) {}
+
+    void close();
+    int read(unsigned char *buffer, int size);
+    int get_fd() const { return fd; }
+    bool is_open() const { return fd >= 0; }
+
+protected:
+    int fd;
+};
+
+// a serial device, 8N1 raw
+class TtyTransport : public FdTransport
+{
+public:
+    bool open(const char *address, unsigned int speed);
+
+    static const bool reopen_at_eof = true;
+};
+
+// "<host>:<port>", e.g. a serial to Ethernet converter or ser2net in raw mode
+// the name is resolved once, the reconnections reuse the address
+class TcpTransport : public FdTransport
+{
+public:
+    TcpTransport() : addr_len(0) {}
+
+    // look the host up (may block and allocate: call it during setup)
+    bool resolve(const char *address);
+
+    bool open(const char *address, unsigned int);
+
+    static const bool reopen_at_eof = true;
+
+private:
+    struct sockaddr_storage addr;
+    socklen_t addr_len; // 0 until resolved
+};
+
+// a stream socket path, e.g. socat relaying a remote port
+class UnixTransport : public FdTransport
+{
+public:
+    bool open(const char *address, unsigned int);
+
+    static const bool reopen_at_eof = true;
+};
+
+// a file of raw ve.direct bytes, read once as fast as possible
+class FileTransport : public FdTransport
+{
+public:
+    bool open(const char *address, unsigned int);
+
+    static const bool reopen_at_eof = false;
+};
+
+#endif
+
+#endif
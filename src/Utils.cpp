@@ -21,31 +21,98 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 
 #ifdef ESP32_ARCH
 #include <Arduino.h>
+#else
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #endif
 
+RealClock real_clock;
+static TimeSource *time_source = &real_clock;
+
+void set_time_source(TimeSource *source)
+{
+  time_source = source ? source : &real_clock;
+}
+
 unsigned long _millis(void)
+{
+  return time_source->millis();
+}
+
+unsigned long _micros(void)
+{
+  return time_source->micros();
+}
+
+unsigned long long _wall_millis(void)
+{
+  return time_source->wall_millis();
+}
+
+int msleep(long msec)
+{
+  return time_source->sleep(msec);
+}
+
+int wait_readable(int fd, long msec)
+{
+    return wait_readable(&fd, 1, msec);
+}
+
+int wait_readable(const int *fds, int n, long msec)
+{
+  return time_source->wait_readable(fds, n, msec);
+}
+
+int VirtualClock::sleep(long msec)
+{
+  if (msec > 0)
+    now_us += (unsigned long long)msec * 1000;
+  return 0;
+}
+
+int VirtualClock::wait_readable(const int *fds, int n, long msec)
+{
+  // the simulated input is pushed by timers, the wait is always a timeout
+  return sleep(msec);
+}
+
+unsigned long RealClock::millis(void)
 {
   #ifndef ESP32_ARCH
-  long            ms; // Milliseconds
-  time_t          s;  // Seconds
+  // monotonic: the timers must not stop or race when the wall clock is stepped (NTP, GPS)
   struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (unsigned long)spec.tv_sec * 1000UL + spec.tv_nsec / 1000000;
+  #else
+  return ::millis();
+  #endif
+}
 
-  clock_gettime(CLOCK_REALTIME, &spec);
-
-  s  = spec.tv_sec;
-  ms = round(spec.tv_nsec / 1.0e6); // Convert nanoseconds to milliseconds
-  if (ms > 999) {
-      s++;
-      ms = 0;
-  }
+unsigned long RealClock::micros(void)
+{
+  #ifndef ESP32_ARCH
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return spec.tv_sec * 1000000UL + spec.tv_nsec / 1000;
+  #else
+  return ::micros();
+  #endif
+}
 
-  return s * 1000 + ms;
+unsigned long long RealClock::wall_millis(void)
+{
+  #ifndef ESP32_ARCH
+  struct timespec spec;
+  clock_gettime(CLOCK_REALTIME, &spec);
+  return (unsigned long long)spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
   #else
-  return millis();
+  return ::millis();
   #endif
 }
 
-int msleep(long msec)
+int RealClock::sleep(long msec)
 {
   #ifndef ESP32_ARCH
     struct timespec ts;
@@ -70,3 +137,60 @@ int msleep(long msec)
     return 0;
     #endif
 }
+
+int RealClock::wait_readable(const int *fds, int n, long msec)
+{
+  #ifndef ESP32_ARCH
+    struct pollfd pfd[8];
+    int k = 0;
+    for (int i = 0; i < n && k < 8; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            pfd[k].fd = fds[i];
+            pfd[k].events = POLLIN;
+            pfd[k].revents = 0;
+            k++;
+        }
+    }
+    if (k)
+    {
+        int res = poll(pfd, k, msec);
+        if (res < 0)
+            return (errno == EINTR) ? 0 : -1;
+        return res > 0 ? 1 : 0;
+    }
+  #endif
+    sleep(msec);
+    return 0;
+}
+
+#ifndef ESP32_ARCH
+bool pin_current_thread(int cpu)
+{
+    if (cpu < 0)
+        return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool start_thread(void *(*fun)(void *), void *ctx, int cpu)
+{
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    int res = pthread_create(&t, &attr, fun, ctx);
+    pthread_attr_destroy(&attr);
+    return res == 0;
+}
+#endif
@@ -15,7 +15,68 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef UTILS_H
 #define UTILS_H
 
-unsigned long _millis();
+// the clock behind _millis(), _micros(), msleep() and wait_readable();
+// the real one unless a simulation replaces it
+class TimeSource
+{
+public:
+    virtual ~TimeSource() {}
+
+    virtual unsigned long millis() = 0;
+    virtual unsigned long micros() = 0;
+    virtual unsigned long long wall_millis() = 0;
+    virtual int sleep(long msec) = 0;
+    virtual int wait_readable(const int *fds, int n, long msec) = 0;
+};
+
+class RealClock : public TimeSource
+{
+public:
+    unsigned long millis();
+    unsigned long micros();
+    unsigned long long wall_millis();
+    int sleep(long msec);
+    int wait_readable(const int *fds, int n, long msec);
+};
+
+// simulated time, starting at "start" ms: it only moves when slept or waited on,
+// and then instantly; nothing ever becomes readable. Single threaded use only.
+class VirtualClock : public TimeSource
+{
+public:
+    VirtualClock(unsigned long long start) : now_us(start * 1000) {}
+
+    unsigned long millis() { return (unsigned long)(now_us / 1000); }
+    unsigned long micros() { return (unsigned long)now_us; }
+    unsigned long long wall_millis() { return now_us / 1000; }
+    int sleep(long msec);
+    int wait_readable(const int *fds, int n, long msec);
+
+private:
+    unsigned long long now_us;
+};
+
+extern RealClock real_clock;
+
+// NULL goes back to the real clock
+void set_time_source(TimeSource *source);
+
+unsigned long _millis(); // monotonic, for timers and intervals, wraps on 32 bits
+unsigned long _micros(); // monotonic, for measuring intervals
+unsigned long long _wall_millis(); // ms since the epoch, 64 bits also on 32 bits boards
 int msleep(long msec);
 
+// wait up to msec for fd to become readable (plain sleep if fd < 0)
+// returns 1 if readable, 0 on timeout, -1 on error
+int wait_readable(int fd, long msec);
+int wait_readable(const int *fds, int n, long msec);
+
+#ifndef ESP32_ARCH
+// start a detached thread, pinned to "cpu" unless it is negative
+bool start_thread(void *(*fun)(void *), void *ctx, int cpu = -1);
+
+// pin the calling thread to "cpu"
+bool pin_current_thread(int cpu);
+#endif
+
 #endif
@@ -16,9 +16,16 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 #include "VeDirect.h"
 #include "Utils.h"
 #include "Log.h"
+#include "Trace.h"
+#include "Metrics.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+static const unsigned long AGE_BOUNDS_MS[] = {500, 1000, 2000, 3000, 5000, 10000, 30000, 60000};
+static MetricHistogram m_field_age("vedirect_field_age_seconds", "Age of the ve.direct values at the end of each frame, older than their budget are dropped", AGE_BOUNDS_MS, sizeof(AGE_BOUNDS_MS) / sizeof(AGE_BOUNDS_MS[0]), 1e-3);
+static MetricCounter m_expired("vedirect_fields_expired_total", "ve.direct values dropped for not being refreshed within their budget");
+
 /*
 VE.Direct format:
 
@@ -42,8 +49,9 @@ static const char *EMPTY_STRING = "";
 
 int _read_vedirect(char *output, const char *tag, const char *line)
 {
-    char str[80];
-    strcpy(str, line);
+    char str[VE_LINE_SIZE];
+    strncpy(str, line, VE_LINE_SIZE - 1);
+    str[VE_LINE_SIZE - 1] = 0;
     char *token;
     token = strtok(str, "\t");
     if (token && strcmp(tag, token) == 0)
@@ -51,7 +59,7 @@ int _read_vedirect(char *output, const char *tag, const char *line)
         token = strtok(NULL, "\t");
         if (token)
         {
-            strcpy(output, token);
+            strcpy(output, token); // output is VE_LINE_SIZE too
             return -1;
         }
     }
@@ -60,7 +68,7 @@ int _read_vedirect(char *output, const char *tag, const char *line)
 
 int read_vedirect_int(int &v, const char *tag, const char *line)
 {
-    char token[80];
+    char token[VE_LINE_SIZE];
     if (_read_vedirect(token, tag, line))
     {
         if (strcmp("---", token) == 0)
@@ -89,10 +97,10 @@ int read_vedirect(double &v, double precision, const char *tag, const char *line
 
 int read_vedirect_onoff(bool &v, const char *tag, const char *line)
 {
-    char token[80];
+    char token[VE_LINE_SIZE];
     if (_read_vedirect(token, tag, line))
     {
-        v = strcmp("ON", token);
+        v = strcmp("ON", token) == 0;
         return -1;
     }
     return 0;
@@ -102,41 +110,71 @@ VEDirectObject::VEDirectObject(const VEDirectValueDefinition *definition, int le
 {
     i_values = new int[n_fields];
     last_time = new unsigned long[n_fields];
-    s_values = new char *[n_fields];
-    for (int i = 0; i < n_fields; i++)
-        s_values[i] = NULL;
+    budget = new unsigned long[n_fields];
+    s_values = new char[n_fields][VE_STRING_SIZE];
+    for (unsigned int i = 0; i < n_fields; i++)
+        budget[i] = fields[i].veBudget;
     reset();
 }
 
 VEDirectObject::~VEDirectObject()
 {
-    delete i_values;
-    delete last_time;
-    for (int i = 0; i < n_fields; i++)
-    {
-        if (s_values[i])
-            delete s_values[i];
-    }
-    delete s_values;
+    delete[] i_values;
+    delete[] last_time;
+    delete[] budget;
+    delete[] s_values;
 }
 
 void VEDirectObject::reset()
 {
-    for (int i = 0; i < n_fields; i++)
+    for (unsigned int i = 0; i < n_fields; i++)
     {
         last_time[i] = 0;
         i_values[i] = 0;
-        if (s_values[i])
-            delete s_values[i];
-        s_values[i] = NULL;
+        s_values[i][0] = 0;
+    }
+    valid = 0;
+}
+
+int VEDirectObject::commit(unsigned long now)
+{
+    int fresh = 0;
+    for (unsigned int i = 0; i < n_fields; i++)
+    {
+        if (!last_time[i])
+            continue;
+        unsigned long age = now - last_time[i];
+        if (age > budget[i])
+        {
+            Log::trace("Field {%s} expired {%lu ms}\n", fields[i].veName, age);
+            m_expired.inc();
+            last_time[i] = 0;
+            continue;
+        }
+        m_field_age.observe(age);
+        fresh++;
     }
     valid = 0;
+    return fresh;
+}
+
+long VEDirectObject::get_age(unsigned int index, unsigned long now)
+{
+    if (index >= n_fields || !last_time[index])
+        return -1;
+    return (long)(now - last_time[index]);
+}
+
+void VEDirectObject::set_budget(unsigned int index, unsigned long _budget)
+{
+    if (index < n_fields)
+        budget[index] = _budget;
 }
 
 void VEDirectObject::print()
 {
     Log::trace("New ve.direct object\n");
-    for (int i = 0; i < n_fields; i++)
+    for (unsigned int i = 0; i < n_fields; i++)
     {
         if (last_time[i])
             switch (fields[i].veType)
@@ -162,7 +200,8 @@ void VEDirectObject::print()
 
 void VEDirectObject::load_VEDirect_key_value(const char *line, unsigned long time)
 {
-    for (int i = 0; i < BMV_N_FIELDS; i++)
+    TRACE_SCOPE("vedirect.parse");
+    for (unsigned int i = 0; i < BMV_N_FIELDS; i++)
     {
         const VEDirectValueDefinition def = BMV_FIELDS[i];
         switch (def.veType)
@@ -189,16 +228,15 @@ void VEDirectObject::load_VEDirect_key_value(const char *line, unsigned long tim
         break;
         case VEFieldType::VE_STRING:
         {
-            static char str[80];
+            static char str[VE_LINE_SIZE];
             if (_read_vedirect(str, def.veName, line))
             {
-                if (s_values[def.veIndex] == NULL)
-                    delete s_values[def.veIndex];
-                s_values[def.veIndex] = strdup(str);
+                snprintf(s_values[def.veIndex], VE_STRING_SIZE, "%s", str);
                 last_time[i] = time;
                 valid++;
             }
         }
+        break;
         default:
             break;
         }
@@ -207,7 +245,7 @@ void VEDirectObject::load_VEDirect_key_value(const char *line, unsigned long tim
 
 int VEDirectObject::get_number_value(int &value, unsigned int index)
 {
-    if (index > n_fields)
+    if (index >= n_fields)
         return 0;
     VEDirectValueDefinition field = fields[index];
     if (field.veIndex < BMV_N_FIELDS && last_time[field.veIndex])
@@ -223,7 +261,7 @@ int VEDirectObject::get_number_value(int &value, unsigned int index)
 
 int VEDirectObject::get_number_value(double &value, double precision, unsigned int index)
 {
-    if (index > n_fields)
+    if (index >= n_fields)
         return 0;
     VEDirectValueDefinition field = fields[index];
     if (field.veIndex < BMV_N_FIELDS && last_time[field.veIndex])
@@ -239,7 +277,7 @@ int VEDirectObject::get_number_value(double &value, double precision, unsigned i
 
 int VEDirectObject::get_boolean_value(bool &value, unsigned int index)
 {
-    if (index > n_fields)
+    if (index >= n_fields)
         return 0;
     VEDirectValueDefinition field = fields[index];
     if (field.veIndex < BMV_N_FIELDS && last_time[field.veIndex])
@@ -255,14 +293,14 @@ int VEDirectObject::get_boolean_value(bool &value, unsigned int index)
 
 unsigned long VEDirectObject::get_last_timestamp(unsigned int index)
 {
-    if (index > n_fields)
+    if (index >= n_fields)
         return 0;
     return last_time[index];
 }
 
 int VEDirectObject::get_string_value(char *value, unsigned int index)
 {
-    if (s_values[index])
+    if (index < n_fields && last_time[index])
     {
         strcpy(value, s_values[index]);
         return -1;
@@ -275,6 +313,75 @@ bool VEDirectObject::is_valid()
     return valid;
 }
 
+// "Hn\t...": n, 0 if the line is not a history field
+static unsigned int history_field(const char *line)
+{
+    if (line[0] != 'H' || line[1] < '0' || line[1] > '9')
+        return 0;
+    unsigned int n = 0;
+    const char *p = line + 1;
+    while (*p >= '0' && *p <= '9' && n <= VE_HISTORY_FIELDS)
+        n = n * 10 + *(p++) - '0';
+    return (*p == '\t' && n <= VE_HISTORY_FIELDS) ? n : 0;
+}
+
+VEBlockType ve_block_type(const char *line)
+{
+    return history_field(line) ? VE_BLOCK_HISTORY : VE_BLOCK_LIVE;
+}
+
+VEDirectHistory::VEDirectHistory() : received(0), changed(0), stale(0), version(0), last_time(0)
+{
+    for (int i = 0; i < VE_HISTORY_FIELDS; i++)
+    {
+        raw[i][0] = 0;
+        values[i] = 0;
+    }
+}
+
+bool VEDirectHistory::load_line(const char *line)
+{
+    unsigned int n = history_field(line);
+    if (n == 0)
+        return false;
+    const char *value = strchr(line, '\t') + 1;
+    uint32_t bit = 1u << (n - 1);
+    // most fields stay the same from block to block, only a changed one is copied
+    if (!(received & bit) || strncmp(raw[n - 1], value, VE_HISTORY_VALUE_SIZE - 1) != 0)
+    {
+        strncpy(raw[n - 1], value, VE_HISTORY_VALUE_SIZE - 1);
+        raw[n - 1][VE_HISTORY_VALUE_SIZE - 1] = 0;
+        received |= bit;
+        changed |= bit;
+        stale |= bit;
+    }
+    return true;
+}
+
+void VEDirectHistory::commit(unsigned long time)
+{
+    if (changed)
+        version++;
+    changed = 0;
+    last_time = time;
+}
+
+int VEDirectHistory::get_value(int &value, unsigned int n)
+{
+    if (n < 1 || n > VE_HISTORY_FIELDS)
+        return 0;
+    uint32_t bit = 1u << (n - 1);
+    if (!(received & bit))
+        return 0;
+    if (stale & bit)
+    {
+        values[n - 1] = strtol(raw[n - 1], NULL, 0);
+        stale &= ~bit;
+    }
+    value = values[n - 1];
+    return -1;
+}
+
 /*
 PID	0xA381
 V	13406
@@ -17,6 +17,28 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 #define _VEDIRECT
 
 #include <math.h>
+#include <stdint.h>
+
+#define VE_STRING_SIZE 32 // longest string field kept (e.g. "BMV 712 Smart")
+#define VE_LINE_SIZE 96   // longest "<label>\t<value>" line parsed, with the terminator; longer ones are cut
+
+// freshness budgets: a value not refreshed for longer is dropped, not republished
+#define VE_FIELD_BUDGET 5000   // ms, live values (the BMV sends them every second)
+#define VE_STATIC_BUDGET 60000 // ms, identity fields (product id, firmware, ...)
+
+// the BMV alternates a live block with a history block (H1..H18), each with its own checksum
+#define VE_HISTORY_FIELDS 18
+#define VE_HISTORY_VALUE_SIZE 16
+
+enum VEBlockType
+{
+    VE_BLOCK_NONE,
+    VE_BLOCK_LIVE,
+    VE_BLOCK_HISTORY
+};
+
+// the type of a block from its first line
+VEBlockType ve_block_type(const char *line);
 
 enum VEFieldType
 {
@@ -30,15 +52,17 @@ class VEDirectValueDefinition
 public:
     VEDirectValueDefinition(VEFieldType type, const char *veDirectName, unsigned int index) : veType(type), veName(veDirectName), veIndex(index){};
     VEDirectValueDefinition(VEFieldType type, const char *veDirectName, unsigned int index, const char *unit) : veType(type), veName(veDirectName), veIndex(index), veUnit(unit){};
+    VEDirectValueDefinition(VEFieldType type, const char *veDirectName, unsigned int index, const char *unit, unsigned long budget) : veType(type), veName(veDirectName), veIndex(index), veUnit(unit), veBudget(budget){};
 
     VEFieldType veType;
     const char *veName;
     unsigned int veIndex;
     const char *veUnit = NULL;
+    unsigned long veBudget = VE_FIELD_BUDGET; // ms
 };
 
 static const unsigned int BMV_N_FIELDS = 14;
-static const VEDirectValueDefinition BMV_PID(VE_NUMBER, "PID", 0);
+static const VEDirectValueDefinition BMV_PID(VE_NUMBER, "PID", 0, NULL, VE_STATIC_BUDGET);
 static const VEDirectValueDefinition BMV_VOLTAGE(VE_NUMBER, "V", 1, "mV");
 static const VEDirectValueDefinition BMV_VOLTAGE_1(VE_NUMBER, "VS", 2, "mV");
 static const VEDirectValueDefinition BMV_CURRENT(VE_NUMBER, "I", 3, "mA");
@@ -48,10 +72,10 @@ static const VEDirectValueDefinition BMV_TIME_TO_GO(VE_NUMBER, "TTG", 6, "Minute
 static const VEDirectValueDefinition BMV_ALARM(VE_BOOLEAN, "Alarm", 7);
 static const VEDirectValueDefinition BMV_RELAY(VE_BOOLEAN, "Relay", 8);
 static const VEDirectValueDefinition BMV_ALARM_REASON(VE_NUMBER, "AR", 9, "Enum");
-static const VEDirectValueDefinition BMV_FIRMWARE(VE_STRING, "FW", 10);
-static const VEDirectValueDefinition BMV_MONITOR_MODE(VE_NUMBER, "MON", 11, "Enum");
+static const VEDirectValueDefinition BMV_FIRMWARE(VE_STRING, "FW", 10, NULL, VE_STATIC_BUDGET);
+static const VEDirectValueDefinition BMV_MONITOR_MODE(VE_NUMBER, "MON", 11, "Enum", VE_STATIC_BUDGET);
 static const VEDirectValueDefinition BMV_TEMPERATURE(VE_NUMBER, "T", 12, "C");
-static const VEDirectValueDefinition BMV_BMV(VE_STRING, "BMV", 13);
+static const VEDirectValueDefinition BMV_BMV(VE_STRING, "BMV", 13, NULL, VE_STATIC_BUDGET);
 static const VEDirectValueDefinition BMV_FIELDS[BMV_N_FIELDS] = {
     BMV_PID,
     BMV_VOLTAGE,
@@ -68,6 +92,7 @@ static const VEDirectValueDefinition BMV_FIELDS[BMV_N_FIELDS] = {
     BMV_TEMPERATURE,
     BMV_BMV};
 
+// the last value of each field, kept across frames until its budget runs out
 class VEDirectObject
 {
 public:
@@ -88,19 +113,60 @@ public:
     int get_string_value(char *value, unsigned int index);
     unsigned long get_last_timestamp(unsigned int index);
 
+    // ms since the field was received at "now", -1 if not available
+    long get_age(unsigned int index, unsigned long now);
+
+    // override the budget of a field, in ms
+    void set_budget(unsigned int index, unsigned long budget);
+
+    // end of a frame: drop the values older than their budget, returns the fields left
+    int commit(unsigned long now);
+
+    // forget all the values
     void reset();
 
+    // fields received since the last commit
     bool is_valid();
 
     void print();
 
 private:
-    int n_fields;
+    unsigned int n_fields;
     int *i_values;
-    char** s_values;
+    char (*s_values)[VE_STRING_SIZE]; // reserved once, no allocations per frame
     unsigned long *last_time;
+    unsigned long *budget;
     int valid;
     const VEDirectValueDefinition *fields;
 };
 
+// H1..H18 as received: the raw values are kept and decoded only when asked for
+class VEDirectHistory
+{
+public:
+    VEDirectHistory();
+
+    // keep the value of a "Hn\t<value>" line, false if it is not one
+    bool load_line(const char *line);
+
+    // end of a block with a valid checksum
+    void commit(unsigned long time);
+
+    // value of Hn (1..18), 0 if not received yet
+    int get_value(int &value, unsigned int n);
+
+    // changes whenever a block brings a different value
+    unsigned long get_version() const { return version; }
+    unsigned long get_last_timestamp() const { return last_time; }
+
+private:
+    char raw[VE_HISTORY_FIELDS][VE_HISTORY_VALUE_SIZE];
+    int values[VE_HISTORY_FIELDS];
+    uint32_t received; // one bit per field
+    uint32_t changed;  // in the current block
+    uint32_t stale;    // raw value not decoded yet
+    unsigned long version;
+    unsigned long last_time;
+};
+
 #endif
\ No newline at end of file
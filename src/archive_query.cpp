@@ -0,0 +1,89 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Query the archive written by vedirectN2K -a
+// Usage: vedirect_archive_query <archive> <from> <to> <resolution s>
+// from/to are unix times in seconds, "now", or negative offsets from now (e.g. -86400)
+
+#include "Archive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *COLUMN_NAMES[ARCHIVE_COLUMNS] = {"V", "VS", "I", "SOC", "CE", "T", "Flags"};
+static const double COLUMN_SCALES[ARCHIVE_COLUMNS] = {0.001, 0.001, 0.001, 0.1, 0.001, 1, 1};
+
+static uint64_t parse_time(const char *s, time_t now)
+{
+    if (strcmp(s, "now") == 0)
+        return (uint64_t)now * 1000;
+    long long v = atoll(s);
+    if (v <= 0)
+        v += now;
+    return (uint64_t)v * 1000;
+}
+
+static void print_bucket(const ArchiveBucket &b, void *ctx)
+{
+    char ts[32];
+    time_t t = b.time / 1000;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    printf("%s,%u", ts, b.count);
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+    {
+        const ArchiveColumnSummary &s = b.columns[c];
+        if (s.count == 0)
+            printf(",,,");
+        else if (c == ARCHIVE_FLAGS)
+            printf(",,0x%x,0x%x", s.min, s.max);
+        else
+            printf(",%.3f,%.3f,%.3f", (double)s.sum / s.count * COLUMN_SCALES[c], s.min * COLUMN_SCALES[c], s.max * COLUMN_SCALES[c]);
+    }
+    printf("\n");
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc != 5)
+    {
+        fprintf(stderr, "Usage: vedirect_archive_query <archive> <from> <to> <resolution s>\n"
+                        "Example: vedirect_archive_query /var/lib/vedirectN2K/bank -86400 now 3600\n");
+        return 1;
+    }
+    time_t now = time(NULL);
+    uint64_t from = parse_time(argv[2], now);
+    uint64_t to = parse_time(argv[3], now);
+    uint64_t resolution = (uint64_t)(atof(argv[4]) * 1000);
+
+    ArchiveReader reader;
+    if (!reader.open(argv[1]))
+        return 1;
+
+    printf("time,count");
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++)
+    {
+        if (c == ARCHIVE_FLAGS)
+            printf(",,%s_and,%s_or", COLUMN_NAMES[c], COLUMN_NAMES[c]);
+        else
+            printf(",%s_mean,%s_min,%s_max", COLUMN_NAMES[c], COLUMN_NAMES[c], COLUMN_NAMES[c]);
+    }
+    printf("\n");
+    int decoded = reader.query(from, to, resolution, print_bucket, NULL);
+    fprintf(stderr, "%d blocks decoded\n", decoded);
+    return 0;
+}
@@ -25,70 +25,318 @@ along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
 #include "Ports.h"
 #include "Log.h"
 #include "VeDirect.h"
+#include "Scheduler.h"
+#include "Battery.h"
+#include "Metrics.h"
+#include "BatteryAnalytics.h"
+#include "HistoryMetrics.h"
+#include "BatteryBank.h"
+#include "Alloc.h"
+#include "Trace.h"
+#include "Mapping.h"
+#include "Config.h"
 
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+
+#ifndef ESP32_ARCH
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include "SPSCQueue.h"
+#include "SharedState.h"
+#include "SignalK.h"
+#include "Capture.h"
+#include "ArchiveSink.h"
+#include "Realtime.h"
+#include "Discovery.h"
+#include "Rebroadcast.h"
+#endif
 
-#define CAPACITY 280.0
-#define INSTANCE 0
-#define INSTANCE_E 1
 #define VEDIRECT_RX 15
 #define VEDIRECT_TX 19
-#define VEDIRECT_BAUD_RATE 19200
+#define N2K_POLL_PERIOD 100
+#define MAX_DEVICES CONFIG_MAX_DEVICES
+#define BANK_EXPIRE_PERIOD 1000
+#ifdef ESP32_ARCH
+#define MAX_IDLE_WAIT 50 // Serial2 cannot be waited on, don't let its rx buffer fill up
+#else
+#define MAX_IDLE_WAIT 1000
+#endif
 
 N2K n2k;
+Scheduler scheduler;
+SchedulerTimer n2k_timer;
+unsigned long frames = 0;
+bool no_heap = false; // abort on any heap allocation once running
+
+static const unsigned long LATENCY_BOUNDS_US[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000};
+static const int LATENCY_N_BOUNDS = sizeof(LATENCY_BOUNDS_US) / sizeof(unsigned long);
+MetricHistogram m_frame_latency("vedirect_frame_to_send_seconds", "Time from frame validation to the N2K messages being handed to the bus", LATENCY_BOUNDS_US, LATENCY_N_BOUNDS, 1e-6);
+MetricHistogram m_loop_time("vedirect_loop_iteration_seconds", "Busy time of one main loop iteration, waits excluded", LATENCY_BOUNDS_US, LATENCY_N_BOUNDS, 1e-6);
+
+// the running config and the spare buffer a reload (SIGHUP) builds the next one in;
+// both are only used by the N2K thread, which also runs the reload: the reader
+// thread gets what it needs through Device::shm_instance
+Config configs[2];
+std::atomic<const Config *> config(&configs[0]);
+const char *config_file = NULL;
+const char *discovery_map = NULL; // serial number map of the "auto" port
+
+// one ve.direct monitor, its capacity and instances come from the config (device n)
+struct Device
+{
 #ifdef ESP32_ARCH
-VEDirectPort veDirect(VEDIRECT_RX, VEDIRECT_TX, VEDIRECT_BAUD_RATE);
+  Device(unsigned int n, const Config &c) : port(VEDirectPort::create(VEDIRECT_RX, VEDIRECT_TX, c.speed)),
 #else
-VEDirectPort veDirect("/dev/ttyUSB0", VEDIRECT_BAUD_RATE);
+  Device(unsigned int n, const Config &c) : port(VEDirectPort::create(c.devices[n].port, c.speed)),
 #endif
+                           bmv(BMV_FIELDS, BMV_N_FIELDS), analytics(c.devices[n].capacity, c.devices[n].instance),
+                           history_metrics(c.devices[n].instance), block(VE_BLOCK_NONE), index(n),
+                           shm_instance(c.devices[n].instance)
+  {
+  }
+
+  VEDirectPort *port;
+  VEDirectObject bmv;
+  BatteryAnalytics analytics;
+  VEDirectHistory history;
+  HistoryMetrics history_metrics;
+  VEBlockType block; // of the lines being received
+  unsigned int index;
+  std::atomic<int> shm_instance; // copy of the config instance for the reader thread, set on reload
+};
+
+Device *devices[MAX_DEVICES];
+unsigned int n_devices = 0;
+
+// the devices combined in one virtual bank, published on its own instance (config bank_instance)
+int bank_option = -1; // -B, over the config file
+BatteryBank bank;
+BatteryAnalytics *bank_analytics = NULL;
+SchedulerTimer bank_timer;
 
 char can_device[256];
 
-VEDirectObject bmv(BMV_FIELDS, BMV_N_FIELDS);
+const char *mapping_file = NULL;
+const char *n2k_settings_file = NULL;
+int load_high = N2K_LOAD_HIGH;
+int load_low = N2K_LOAD_LOW;
+MappingPlan mapping;
+
+#ifndef ESP32_ARCH
+#define READINGS_QUEUE_SIZE 16
+
+// threaded mode: the reader thread owns the port and the parser, the main thread owns N2K
+bool threaded = false;
+int reader_cpu = -1;
+int n2k_cpu = -1;
+int rt_priority = 0; // SCHED_FIFO priority of the I/O path, 0 = default scheduling
+SPSCQueue<BatteryReading, READINGS_QUEUE_SIZE> readings;
+int readings_event = -1;
+unsigned long readings_dropped = 0;
+
+int metrics_port = 0;
+MetricsServer metrics_server;
+
+const char *shm_name = NULL;
+SharedState shared_state;
+
+const char *signalk_udp = NULL;
+int signalk_tcp_port = 0;
+SignalKSink signalk;
+
+const char *capture_file = NULL;
+CaptureWriter capture;
+
+const char *archive_path = NULL;
+ArchiveSink archive;
+
+// the ve.direct streams served to other processes, one address per device
+const char *rebroadcast_addresses = NULL;
+bool rebroadcast_frames = false; // only the frames with a valid checksum
+RebroadcastServer *rebroadcast[MAX_DEVICES];
+
+// SIGUSR1 dumps the trace rings
+#define TRACE_DEFAULT_FILE "/tmp/vedirectN2K-trace.json"
+const char *trace_file = NULL;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+// SIGHUP reloads the config file
+volatile sig_atomic_t reload_requested = 0;
+
+// replay of a capture instead of reading the port
+const char *replay_file = NULL;
+double replay_speed = 1.0; // 0 = as fast as possible
+bool simulate = false;      // replay on a virtual clock, as fast as the cpu allows
+CaptureReader replay;
+SchedulerTimer replay_timer;
+unsigned char replay_buffer[CAPTURE_MAX_CHUNK];
+int replay_len = 0;
+double replay_carry_us = 0;
+bool replay_done = false;
+unsigned long replay_bytes = 0;
+#endif
+
+#define MAX_SINKS 4
+OutputSink *sinks[MAX_SINKS];
+int n_sinks = 0;
+
+void add_sink(OutputSink *sink)
+{
+  if (n_sinks < MAX_SINKS)
+    sinks[n_sinks++] = sink;
+}
+
+// handles the main loop waits on, besides the ports
+int sink_fds(int *fds)
+{
+  int n = 0;
+  for (int i = 0; i < n_sinks; i++)
+  {
+    if (sinks[i]->get_fd() >= 0)
+      fds[n++] = sinks[i]->get_fd();
+  }
+  return n;
+}
+
+void poll_sinks()
+{
+  for (int i = 0; i < n_sinks; i++)
+    sinks[i]->poll();
+}
 
 void msg_handler(const tN2kMsg &N2kMsg)
 {
   // nothing to handle, this component just sends out stuff
 }
 
-int handle_vedirect(const char *line)
+// nominal capacity of the bank
+double bank_capacity(const Config &c)
+{
+  double capacity = 0;
+  for (unsigned int i = 0; i < c.n_devices; i++)
+    capacity += c.devices[i].capacity;
+  return capacity;
+}
+
+// fold a member frame into the bank and publish the bank figures
+void send_bank(int bank_instance, unsigned char sid, const BatteryReading &member, double capacity, double ttg)
+{
+  TRACE_SCOPE("frame.bank");
+  bank.update(member.device, member, capacity, ttg);
+  const BatteryReading &r = bank.get_reading();
+  bank_analytics->add(r);
+  BatteryStats stats = bank_analytics->get_stats();
+  stats.ttg = r.ttg; // the first member to run out
+  stats.capacity = bank.get_capacity();
+  n2k.sendBattery(sid, r.voltage, r.current, r.temperature, bank_instance);
+  n2k.sendBatteryStatus(sid, r.soc, stats.capacity, stats.ttg, bank_instance, stats.soh);
+#ifndef ESP32_ARCH
+  shared_state.publish(n_devices, bank_instance, r);
+#endif
+  for (int i = 0; i < n_sinks; i++)
+    sinks[i]->publish(r, stats, bank_instance, bank_instance);
+}
+
+void on_bank_timer(void *ctx)
+{
+  bank.expire(_millis());
+}
+
+void send_reading(const BatteryReading &r)
 {
+  TRACE_FRAME(r.frame);
+  TRACE_SCOPE("frame.send");
+  static unsigned char sid = 0;
+  sid++;
+  Device *d = devices[r.device];
+  const Config *cfg = config.load();
+  const ConfigDevice &c = cfg->devices[r.device];
+  d->analytics.add(r);
+  const BatteryStats &stats = d->analytics.get_stats();
+  double ttg = (stats.ttg != N2kDoubleNA) ? stats.ttg : r.ttg; // fall back on the monitor's own estimate
+  Log::trace("Read values: SOC {%.2f%} V0 {%.2f V} V1 {%.2f V} Current {%.2f A}\n", r.soc, r.voltage, r.voltage1, r.current);
+  mapping.publish(n2k, sid, r, stats, ttg, c.instance, c.instance_e);
+  for (int i = 0; i < n_sinks; i++)
+    sinks[i]->publish(r, stats, c.instance, c.instance_e);
+  if (bank_analytics)
+    send_bank(cfg->bank_instance, sid, r, stats.capacity, ttg);
+  for (int i = 0; i < n_sinks; i++)
+    sinks[i]->flush();
+  sid++;
+  m_frame_latency.observe(_micros() - r.stamp);
+}
+
+void publish_reading(const BatteryReading &r)
+{
+#ifndef ESP32_ARCH
+  // local consumers get the frame straight away, from the thread that parsed it
+  shared_state.publish(r.device, devices[r.device]->shm_instance.load(std::memory_order_relaxed), r);
+  if (threaded)
+  {
+    if (!readings.push(r))
+    {
+      readings_dropped++;
+      Log::trace("Readings queue full, dropped frame {%lu} {%lu total}\n", r.frame, readings_dropped);
+    }
+    uint64_t one = 1;
+    if (write(readings_event, &one, sizeof(one)) < 0)
+      Log::trace("Err signaling reading {%lu}\n", r.frame);
+    return;
+  }
+#endif
+  send_reading(r);
+}
+
+int handle_vedirect(const char *line, void *ctx)
+{
+  Device *d = (Device *)ctx;
+  TRACE_FRAME(frames + 1); // the number the frame gets if valid
   if (strstr(line, "Checksum"))
   {
-    if (bmv.is_valid())
-    {
-      static unsigned char sid = 0;
-      sid++;
-      double soc = N2kDoubleNA;
-      double voltage = N2kDoubleNA;
-      double voltage1 = N2kDoubleNA;
-      double current = N2kDoubleNA;
-      double temperature = N2kDoubleNA;
-      double ttg = N2kDoubleNA;
-      bmv.get_number_value(voltage, 0.001, BMV_VOLTAGE); // convert in V from mV
-      bmv.get_number_value(voltage1, 0.001, BMV_VOLTAGE_1); // convert in V from mV
-      bmv.get_number_value(current, 0.001, BMV_CURRENT); // convert in A from mA
-      bmv.get_number_value(soc, 0.1, BMV_SOC); // convert in percentage from 1000ths
-      bmv.get_number_value(temperature, 1, BMV_TEMPERATURE); // celsius
-      //bmv.print();
-      Log::trace("Read values: SOC {%.2f%} V0 {%.2f V} V1 {%.2f V} Current {%.2f A}\n", soc, voltage, voltage1, current);
-      n2k.sendBattery(sid, voltage, current, temperature, INSTANCE);
-      n2k.sendBatteryStatus(sid, soc, CAPACITY, ttg, INSTANCE);
-      n2k.sendBattery(sid++, voltage1, 0, N2kDoubleNA, INSTANCE_E);
-    }
-    bmv.reset();
+    if (d->block == VE_BLOCK_HISTORY)
+    {
+      // history is not live data: nothing to publish, the live values are kept
+      d->history.commit(_millis());
+      d->history_metrics.update(d->history);
+    }
+    else
+    {
+      // the values of this frame plus the ones of earlier frames still within their budget
+      if (d->bmv.is_valid() && d->bmv.commit(_millis()))
+      {
+        BatteryReading r;
+        r.load(d->bmv, ++frames, _millis());
+        r.device = d->index;
+        //d->bmv.print();
+        publish_reading(r);
+      }
+    }
+    d->block = VE_BLOCK_NONE;
   }
   else
   {
-    bmv.load_VEDirect_key_value(line, millis());
+    if (d->block == VE_BLOCK_NONE)
+      d->block = ve_block_type(line);
+    if (d->block == VE_BLOCK_HISTORY)
+      d->history.load_line(line);
+    else
+      d->bmv.load_VEDirect_key_value(line, _millis());
     return 0;
   }
   return -1;
 }
 
+void on_n2k_timer(void *ctx)
+{
+  n2k.loop();
+}
+
 void setup()
 {
 #ifdef ESP32_ARCH
@@ -97,34 +345,583 @@ void setup()
   WiFi.mode(WIFI_OFF);    // Switch WiFi off
   btStop();               // Shut down bluetooth
   setCpuFrequencyMhz(80); // Slow down CPU
-  strcpy(can_device, "dummy");
+  configs[0].set_can_device("dummy");
+  configs[0].set_port(0, "Serial2");
+  strcpy(can_device, configs[0].can_device);
+  if (n_devices == 0)
+    devices[n_devices++] = new Device(0, configs[0]);
 #endif
+  const Config *cfg = config.load();
   // init log
   Log::init();
   // setup N2k
-  n2k.setup(msg_handler, 23, can_device);
-  // setup ve.direct port
-  veDirect.set_handler(handle_vedirect);
+  if (n2k_settings_file)
+    n2k.set_settings_file(n2k_settings_file);
+  n2k.set_load_thresholds(load_high, load_low);
+  n2k.setup(msg_handler, cfg->source, can_device);
+  // compile the ve.direct to N2K mapping
+#ifndef ESP32_ARCH
+  if (!mapping_file || !mapping.load(mapping_file))
+#endif
+    mapping.compile_default();
+  // setup ve.direct ports
+  for (unsigned int i = 0; i < n_devices; i++)
+    devices[i]->port->set_handler(handle_vedirect, devices[i]);
+  // setup periodic jobs
+  scheduler.start(_millis());
+#ifndef ESP32_ARCH
+  if (!threaded && !replay_file)
+#endif
+    for (unsigned int i = 0; i < n_devices; i++)
+      devices[i]->port->attach(scheduler);
+  n2k_timer.set_callback(on_n2k_timer, NULL);
+  scheduler.schedule(n2k_timer, 0, N2K_POLL_PERIOD);
+  if (cfg->bank_instance >= 0)
+  {
+    bank_analytics = new BatteryAnalytics(bank_capacity(*cfg), cfg->bank_instance);
+    bank_timer.set_callback(on_bank_timer, NULL);
+    scheduler.schedule(bank_timer, BANK_EXPIRE_PERIOD, BANK_EXPIRE_PERIOD);
+    Log::trace("Publishing {%d} devices as bank instance {%d}\n", n_devices, cfg->bank_instance);
+  }
+#ifdef ESP32_ARCH
+  // everything is reserved by now
+  Alloc::arm(no_heap);
+#else
+  // a replay feeds the port from the main loop, which serves the clients too
+  if (replay_file)
+    for (unsigned int i = 0; i < n_devices; i++)
+      if (rebroadcast[i])
+        rebroadcast[i]->attach(scheduler);
+#endif
+}
+
+#ifndef ESP32_ARCH
+void on_trace_signal(int sig)
+{
+  trace_dump_requested = 1;
+}
+
+void check_trace_dump()
+{
+  if (trace_dump_requested)
+  {
+    trace_dump_requested = 0;
+    Trace::dump(trace_file ? trace_file : TRACE_DEFAULT_FILE);
+  }
+}
+
+void on_reload_signal(int sig)
+{
+  reload_requested = 1;
+}
+
+// hand the settings that changed over to the running objects (N2K thread)
+void apply_config(const Config &running, const Config &next)
+{
+  for (unsigned int i = 0; i < n_devices; i++)
+  {
+    const ConfigDevice &was = running.devices[i];
+    const ConfigDevice &now = next.devices[i];
+    if (now.capacity != was.capacity)
+      devices[i]->analytics.set_nominal_capacity(now.capacity);
+    if (now.instance != was.instance)
+    {
+      devices[i]->shm_instance.store(now.instance, std::memory_order_relaxed);
+      devices[i]->analytics.set_instance(now.instance);
+      devices[i]->history_metrics.set_instance(now.instance);
+    }
+    if (now.capacity != was.capacity || now.instance != was.instance || now.instance_e != was.instance_e)
+      Log::trace("Device {%u} instance {%d} auxiliary {%d} capacity {%.1f Ah}\n", i, now.instance, now.instance_e, now.capacity);
+  }
+  if (bank_analytics)
+  {
+    if (bank_capacity(next) != bank_capacity(running))
+      bank_analytics->set_nominal_capacity(bank_capacity(next));
+    if (next.bank_instance != running.bank_instance)
+    {
+      bank_analytics->set_instance(next.bank_instance);
+      Log::trace("Publishing {%d} devices as bank instance {%d}\n", n_devices, next.bank_instance);
+    }
+  }
 }
 
+// SIGHUP: read the config file into the spare buffer and swap it in; the ports,
+// the CAN socket and the claimed N2K address are left as they are
+void check_reload()
+{
+  if (!reload_requested)
+    return;
+  reload_requested = 0;
+  if (!config_file)
+  {
+    Log::trace("No config file to reload (-C)\n");
+    return;
+  }
+  const Config *running = config.load();
+  Config *next = (running == &configs[0]) ? &configs[1] : &configs[0];
+  // reading a file is setup work, it may use the heap
+  Alloc::disarm();
+  *next = Config();
+  bool ok = next->load(config_file);
+  Alloc::arm(no_heap);
+  if (!ok)
+  {
+    Log::trace("Config {%s} not reloaded, the running one is kept\n", config_file);
+    return;
+  }
+  if (bank_option >= 0)
+    next->bank_instance = bank_option;
+  next->keep_startup(*running);
+  apply_config(*running, *next);
+  config.store(next);
+  Log::trace("Config {%s} reloaded\n", config_file);
+}
+#endif
+
 void loop()
 {
-  veDirect.listen(50);
-  n2k.loop();
-  msleep(50); // add 50ms pause
+  unsigned long t0 = _micros();
+  scheduler.run(_millis());
+  for (unsigned int i = 0; i < n_devices; i++)
+    devices[i]->port->listen(50);
+  n2k.flush(); // the messages of all the frames read in this iteration, in one go
+  poll_sinks();
+  int fds[1 + MAX_DEVICES + MAX_SINKS];
+  int n_fds = 0;
+  for (unsigned int i = 0; i < n_devices; i++)
+    fds[n_fds++] = devices[i]->port->get_fd();
+#ifndef ESP32_ARCH
+  metrics_server.poll();
+  fds[n_fds++] = metrics_server.get_fd();
+  check_trace_dump();
+  check_reload();
+#endif
+  n_fds += sink_fds(fds + n_fds);
+  m_loop_time.observe(_micros() - t0);
+  // sleep until the next job is due or there is something to read
+  wait_readable(fds, n_fds, n2k.next_timeout(_millis(), scheduler.next_timeout(_millis(), MAX_IDLE_WAIT)));
 }
 
 #ifndef ESP32_ARCH
 
-int main(int argc, const char **argv)
+void *reader_thread(void *ctx)
+{
+  // the port jobs run on their own wheel, in this thread
+  Scheduler reader_scheduler;
+  Trace::set_thread_name("reader");
+  if (rt_priority)
+    Realtime::apply_thread("reader", rt_priority);
+  reader_scheduler.start(_millis());
+  int fds[MAX_DEVICES];
+  for (unsigned int i = 0; i < n_devices; i++)
+    devices[i]->port->attach(reader_scheduler);
+  while (1)
+  {
+    reader_scheduler.run(_millis());
+    for (unsigned int i = 0; i < n_devices; i++)
+    {
+      devices[i]->port->listen(50);
+      fds[i] = devices[i]->port->get_fd();
+    }
+    wait_readable(fds, n_devices, reader_scheduler.next_timeout(_millis(), MAX_IDLE_WAIT));
+  }
+  return NULL;
+}
+
+void n2k_loop()
+{
+  unsigned long t0 = _micros();
+  scheduler.run(_millis());
+  BatteryReading r;
+  while (readings.pop(r))
+  {
+    send_reading(r);
+  }
+  n2k.flush();
+  metrics_server.poll();
+  check_trace_dump();
+  check_reload();
+  poll_sinks();
+  m_loop_time.observe(_micros() - t0);
+  int fds[2 + MAX_SINKS] = {readings_event, metrics_server.get_fd()};
+  int n_fds = 2 + sink_fds(fds + 2);
+  if (wait_readable(fds, n_fds, n2k.next_timeout(_millis(), scheduler.next_timeout(_millis(), MAX_IDLE_WAIT))) > 0)
+  {
+    uint64_t n;
+    if (read(readings_event, &n, sizeof(n)) < 0 && errno != EAGAIN)
+      Log::trace("Err reading readings event\n");
+  }
+}
+
+void schedule_replay()
+{
+  unsigned long delta_us;
+  replay_len = replay.next(replay_buffer, sizeof(replay_buffer), delta_us);
+  if (replay_len <= 0)
+  {
+    if (replay_len < 0)
+      Log::trace("Capture {%s} is corrupted, replay stopped\n", replay_file);
+    replay_done = true;
+    return;
+  }
+  // keep the sub-ms remainders so that the replay does not drift
+  replay_carry_us += delta_us / replay_speed;
+  unsigned long delay = (unsigned long)(replay_carry_us / 1000.0);
+  replay_carry_us -= delay * 1000.0;
+  scheduler.schedule(replay_timer, delay);
+}
+
+void on_replay_timer(void *ctx)
+{
+  devices[0]->port->feed(replay_buffer, replay_len);
+  replay_bytes += replay_len;
+  schedule_replay();
+}
+
+void replay_max_speed()
+{
+  unsigned long delta_us;
+  unsigned long records = 0;
+  int len;
+  while ((len = replay.next(replay_buffer, sizeof(replay_buffer), delta_us)) > 0)
+  {
+    devices[0]->port->feed(replay_buffer, len);
+    n2k.flush();
+    replay_bytes += len;
+    if ((++records & 63) == 0)
+      n2k.loop();
+  }
+  if (len < 0)
+    Log::trace("Capture {%s} is corrupted, replay stopped\n", replay_file);
+}
+
+int run_replay()
+{
+  threaded = false; // the replay feeds the parser from this thread
+  if (!replay.open(replay_file))
+    return 1;
+  // the simulated time starts when the capture was recorded, so that two runs see the same clock
+  VirtualClock sim_clock(replay.get_start_time());
+  if (simulate)
+  {
+    if (replay_speed <= 0)
+      replay_speed = 1.0; // only the timed replay has a timeline to simulate
+    set_time_source(&sim_clock);
+  }
+  setup();
+  Log::trace("Replaying {%s} at %s\n", replay_file, simulate ? "simulated time" : (replay_speed > 0 ? "timed speed" : "max speed"));
+  Alloc::arm(no_heap);
+  unsigned long t0 = real_clock.micros();
+  unsigned long sim_t0 = _millis();
+  if (replay_speed > 0)
+  {
+    replay_timer.set_callback(on_replay_timer, NULL);
+    schedule_replay();
+    while (!replay_done)
+    {
+      loop();
+    }
+  }
+  else
+  {
+    replay_max_speed();
+  }
+  double elapsed = (real_clock.micros() - t0) / 1e6;
+  double simulated = (_millis() - sim_t0) / 1e3;
+  unsigned long allocations = Alloc::get_count();
+  Alloc::disarm();
+  archive.close();
+  if (trace_file)
+    Trace::dump(trace_file);
+  Log::trace("Replay complete: %lu bytes, %lu frames in %.3fs (%.2f MB/s)\n", replay_bytes, frames, elapsed,
+             elapsed > 0 ? replay_bytes / elapsed / 1e6 : 0.0);
+  if (simulate)
+  {
+    Log::trace("Simulated {%.3fs} in {%.3fs} {%.0fx}\n", simulated, elapsed, elapsed > 0 ? simulated / elapsed : 0.0);
+    for (unsigned int i = 0; i < n_devices; i++)
+    {
+      const BatteryStats &st = devices[i]->analytics.get_stats();
+      Log::trace("Device {%d} Ah in {%.4f} Ah out {%.4f} Wh in {%.3f} Wh out {%.3f} capacity {%.2f}\n", i,
+                 st.ah_in, st.ah_out, st.wh_in, st.wh_out, st.capacity);
+    }
+    set_time_source(NULL);
+  }
+  if (Alloc::is_tracking())
+    Log::trace("Heap allocations after setup {%lu} {%.3f per frame}\n", allocations, frames ? (double)allocations / frames : 0.0);
+  return 0;
+}
+
+// one rebroadcast server per device, in the order of the ports
+void open_rebroadcast()
 {
-  if (argc == 3)
+  char addresses[256];
+  strncpy(addresses, rebroadcast_addresses, sizeof(addresses) - 1);
+  addresses[sizeof(addresses) - 1] = 0;
+  unsigned int n = 0;
+  for (char *address = strtok(addresses, ","); address; address = strtok(NULL, ","), n++)
   {
-    Log::trace("Set port [%s]\n", argv[1]);
-    Log::trace("Set can  [%s]\n", argv[2]);
-    strcpy(can_device, argv[2]);
-    veDirect.set_port(argv[1]);
+    if (n >= n_devices)
+    {
+      Log::trace("Err no device for rebroadcast {%s}\n", address);
+      continue;
+    }
+    rebroadcast[n] = new RebroadcastServer();
+    if (rebroadcast[n]->open(address))
+      devices[n]->port->set_rebroadcast(rebroadcast[n], rebroadcast_frames);
+  }
+}
+
+// a port named "auto" asks for the discovery of the USB serial ports
+bool discovery_requested(const Config &c)
+{
+  for (unsigned int i = 0; i < c.n_devices; i++)
+    if (strcmp(c.devices[i].port, "auto") == 0)
+      return true;
+  return false;
+}
+
+void usage()
+{
+  Log::trace("Usage: vedirectN2K [-t] [-r <cpu>] [-n <cpu>] [-P <prio>] [-m <port>] [-s <name>] [-u <host:port>] [-T <port>] [-c <file>] [-a <path>] [-H] [-B <instance>] [-D <file>] [-M <file>] [-I <file>] [-L <high>[,<low>]] [-C <file>] [-A <file>] [-W <address>[,...]] [-F] <ve.direct port>[,<port>...] <can port>\n"
+             "       vedirectN2K -C <file> [options]\n"
+             "       vedirectN2K -R <file> [-x <speed>] [-S] [options] <can port>\n"
+             "  -t        run the serial reader and the N2K sender on separate threads\n"
+             "  -r <cpu>  pin the reader thread to a cpu (threaded mode)\n"
+             "  -n <cpu>  pin the N2K thread (the main loop when not threaded) to a cpu\n"
+             "  -P <prio> real-time profile: SCHED_FIFO at prio (1-99), locked and prefaulted memory\n"
+             "  -m <port> serve prometheus metrics over HTTP on this port\n"
+             "  -s <name> publish the live state in a shared memory segment (e.g. /vedirectN2K)\n"
+             "  -u <host:port> send Signal K deltas over UDP (unicast or multicast)\n"
+             "  -T <port> serve Signal K deltas to TCP clients on this port\n"
+             "  -c <file> capture the raw serial data to a file\n"
+             "  -a <path> archive the values in <path>.dat/<path>.idx\n"
+             "  -H        abort on any heap allocation after startup (needs VEDIRECT_ALLOC_TRACKING)\n"
+             "  -B <instance> publish the sum of all the monitors as one bank on this N2K instance\n"
+             "  -D <file> where SIGUSR1 dumps the trace (default " TRACE_DEFAULT_FILE "), a replay dumps at the end\n"
+             "  -M <file> ve.direct to N2K mapping (see Mapping.h), default V/I/T/SOC on n, VS on n+1\n"
+             "  -I <file> where the N2K transmission intervals set from the bus are kept (default " N2K_SETTINGS_FILE ")\n"
+             "  -L <high>[,<low>] bus load %% above which 127506 is sent less often, below which it recovers (default %d,%d)\n"
+             "  -C <file> config file (see Config.h), reloaded on SIGHUP; the arguments override its ports and CAN device\n"
+             "  -A <file> serial number to device map of the \"auto\" port (default " DISCOVERY_MAP_FILE ")\n"
+             "  -W <address>[,<address>...] serve the ve.direct stream of each port to other processes (TCP port or unix:<path>)\n"
+             "  -F        serve only the frames with a valid checksum (-W)\n"
+             "  -R <file> replay a capture instead of reading the port\n"
+             "  -x <speed> replay speed factor (default 1, 0 = as fast as possible)\n"
+             "  -S        simulate: run the timed replay on a virtual clock, deterministic and with no waits\n"
+             "Use \"auto\" as ve.direct port to find the monitors on the USB serial ports.\n"
+             "Use \"" N2K_NULL_DEVICE "\" as can port to discard the N2K output.\n"
+             "Monitor n (from 0) is published on instances %d+2n and %d+2n (auxiliary voltage).\n"
+             "Example: vedirectN2K /dev/ttyUSB0 can0\n",
+             N2K_LOAD_HIGH, N2K_LOAD_LOW, CONFIG_INSTANCE, CONFIG_INSTANCE_E);
+}
+
+int main(int argc, char *const *argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "tr:n:P:m:s:u:T:c:R:x:Sa:HB:D:M:I:L:C:A:W:F")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      threaded = true;
+      break;
+    case 'r':
+      reader_cpu = atoi(optarg);
+      break;
+    case 'n':
+      n2k_cpu = atoi(optarg);
+      break;
+    case 'P':
+      rt_priority = atoi(optarg);
+      if (rt_priority < 1 || rt_priority > 99)
+      {
+        usage();
+        return 1;
+      }
+      break;
+    case 'm':
+      metrics_port = atoi(optarg);
+      break;
+    case 's':
+      shm_name = optarg;
+      break;
+    case 'u':
+      signalk_udp = optarg;
+      break;
+    case 'T':
+      signalk_tcp_port = atoi(optarg);
+      break;
+    case 'c':
+      capture_file = optarg;
+      break;
+    case 'a':
+      archive_path = optarg;
+      break;
+    case 'H':
+      no_heap = true;
+      break;
+    case 'M':
+      mapping_file = optarg;
+      break;
+    case 'I':
+      n2k_settings_file = optarg;
+      break;
+    case 'L':
+    {
+      int n = sscanf(optarg, "%d,%d", &load_high, &load_low);
+      if (n == 1)
+        load_low = load_high * N2K_LOAD_LOW / N2K_LOAD_HIGH;
+      if (n < 1 || load_high < 1 || load_high > 100 || load_low < 0 || load_low >= load_high)
+      {
+        usage();
+        return 1;
+      }
+      break;
+    }
+    case 'D':
+      trace_file = optarg;
+      break;
+    case 'B':
+      bank_option = atoi(optarg);
+      break;
+    case 'C':
+      config_file = optarg;
+      break;
+    case 'A':
+      discovery_map = optarg;
+      break;
+    case 'W':
+      rebroadcast_addresses = optarg;
+      break;
+    case 'F':
+      rebroadcast_frames = true;
+      break;
+    case 'R':
+      replay_file = optarg;
+      break;
+    case 'x':
+      replay_speed = atof(optarg);
+      break;
+    case 'S':
+      simulate = true;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (no_heap && !Alloc::is_tracking())
+  {
+    Log::trace("Err -H needs a build with VEDIRECT_ALLOC_TRACKING, the heap is not hooked\n");
+    return 1;
+  }
+
+  Config &startup = configs[0];
+  if (config_file && !startup.load(config_file))
+    return 1;
+  if (bank_option >= 0)
+    startup.bank_instance = bank_option;
+  int n_args = argc - optind;
+  if (n_args == (replay_file ? 1 : 2) || (config_file && n_args == 0))
+  {
+    if (n_args == 2)
+    {
+      // the ports of the command line take the place of the ones of the config file
+      char ports[256];
+      strncpy(ports, argv[optind], sizeof(ports) - 1);
+      ports[sizeof(ports) - 1] = 0;
+      startup.n_devices = 0;
+      for (char *name = strtok(ports, ","); name && startup.n_devices < MAX_DEVICES; name = strtok(NULL, ","))
+        startup.set_port(startup.n_devices, name);
+    }
+    if (n_args)
+      startup.set_can_device(argv[argc - 1]);
+    if (replay_file)
+    {
+      startup.n_devices = 0;
+      startup.set_port(0, "replay");
+    }
+    if (startup.n_devices == 0 || !startup.can_device[0])
+    {
+      Log::trace("Err no ve.direct port or CAN device\n");
+      usage();
+      return 1;
+    }
+    if (!replay_file && discovery_requested(startup))
+    {
+      Discovery discovery;
+      discovery.scan();
+      discovery.identify(startup.speed);
+      if (discovery.bind(startup, discovery_map ? discovery_map : DISCOVERY_MAP_FILE) == 0)
+      {
+        Log::trace("Err no ve.direct device found\n");
+        return 1;
+      }
+    }
+    for (n_devices = 0; n_devices < startup.n_devices; n_devices++)
+    {
+      if (!replay_file)
+        Log::trace("Set port [%s] instance {%d}\n", startup.devices[n_devices].port, startup.devices[n_devices].instance);
+      devices[n_devices] = new Device(n_devices, startup);
+    }
+    Log::trace("Set can  [%s]\n", startup.can_device);
+    Trace::set_thread_name(threaded ? "n2k" : "main");
+    signal(SIGUSR1, on_trace_signal);
+    signal(SIGHUP, on_reload_signal);
+    strcpy(can_device, startup.can_device);
+    if (metrics_port)
+      metrics_server.open(metrics_port);
+    if (shm_name)
+      shared_state.open(shm_name, n_devices + (startup.bank_instance >= 0 ? 1 : 0));
+    if (signalk_udp || signalk_tcp_port)
+    {
+      if (signalk_udp)
+        signalk.open_udp(signalk_udp);
+      if (signalk_tcp_port)
+        signalk.open_tcp(signalk_tcp_port);
+      add_sink(&signalk);
+    }
+    if (archive_path && archive.open(archive_path, startup.bank_instance >= 0 ? startup.bank_instance : startup.devices[0].instance))
+      add_sink(&archive);
+    if (rebroadcast_addresses)
+      open_rebroadcast();
+    if (replay_file)
+      return run_replay();
+    if (capture_file && capture.open(capture_file))
+      devices[0]->port->set_capture(&capture);
     setup();
+    if (rt_priority)
+      Realtime::lock_memory(); // before the reader thread, so that its stack is locked too
+    if (threaded)
+    {
+      readings_event = eventfd(0, EFD_NONBLOCK);
+      if (readings_event < 0 || !start_thread(reader_thread, NULL, reader_cpu))
+      {
+        Log::trace("Err starting reader thread\n");
+        return 1;
+      }
+      if (!pin_current_thread(n2k_cpu))
+        Log::trace("Err pinning N2K thread to cpu {%d}\n", n2k_cpu);
+      Log::trace("Threaded mode, reader cpu {%d} N2K cpu {%d}\n", reader_cpu, n2k_cpu);
+      if (rt_priority)
+      {
+        Realtime::apply_thread("n2k", rt_priority);
+        Realtime::self_check();
+      }
+      Alloc::arm(no_heap);
+      while (1)
+      {
+        n2k_loop();
+      }
+    }
+    if (!pin_current_thread(n2k_cpu))
+      Log::trace("Err pinning main thread to cpu {%d}\n", n2k_cpu);
+    if (rt_priority)
+    {
+      Realtime::apply_thread("main", rt_priority);
+      Realtime::self_check();
+    }
+    Alloc::arm(no_heap);
     while (1)
     {
       loop();
@@ -132,7 +929,7 @@ int main(int argc, const char **argv)
   }
   else
   {
-    Log::trace("Usage: vedirectN2K <ve.direct port> <can port>\nExample: vedirectN2K /dev/ttyUSB0 can0\n");
+    usage();
   }
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,57 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Example consumer of the shared memory published by vedirectN2K -s
+// Usage: vedirect_shm_reader [<segment name>] [<period ms>]
+
+#include "BatteryShm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, const char **argv)
+{
+    const char *name = (argc > 1) ? argv[1] : BATTERY_SHM_DEFAULT_NAME;
+    long period = (argc > 2) ? atol(argv[2]) : 1000;
+
+    const BatteryShmSegment *shm = battery_shm_open(name);
+    if (shm == NULL)
+    {
+        fprintf(stderr, "Cannot open shared memory {%s}\n", name);
+        return 1;
+    }
+
+    uint64_t last_frame[BATTERY_SHM_MAX_DEVICES] = {0};
+    struct timespec ts;
+    ts.tv_sec = period / 1000;
+    ts.tv_nsec = (period % 1000) * 1000000;
+    while (1)
+    {
+        for (unsigned int i = 0; i < shm->n_devices; i++)
+        {
+            BatteryShmRecord r;
+            if (battery_shm_read(shm, i, r) && r.frame != last_frame[i])
+            {
+                last_frame[i] = r.frame;
+                printf("Device %u instance %d frame %llu: V {%.2f} VS {%.2f} I {%.2f} SOC {%.1f} TTG {%.0f}\n",
+                       i, r.instance, (unsigned long long)r.frame, r.voltage, r.voltage1, r.current, r.soc, r.ttg);
+            }
+        }
+        fflush(stdout);
+        nanosleep(&ts, NULL);
+    }
+    battery_shm_close(shm);
+    return 0;
+}
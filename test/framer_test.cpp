@@ -0,0 +1,251 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Corrupted streams through VEDirectPort::feed: the frames handed over and the
+// resync and lost byte counters, for each stream fed at once and split at every offset
+// Usage: vedirect_framer_test
+
+#include "Ports.h"
+#include "Metrics.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_STREAM 2048
+#define MAX_OUTPUT 4096
+
+// no transport, the bytes come from feed()
+class TestPort : public VEDirectPort
+{
+public:
+    TestPort() : VEDirectPort("test", 19200) {}
+
+    void listen(unsigned int) {}
+    void close() {}
+    int get_fd() const { return -1; }
+
+protected:
+    void try_open() {}
+};
+
+struct Output
+{
+    char text[MAX_OUTPUT];
+    int len;
+    int frames;
+};
+
+static int errors = 0;
+
+static int on_line(const char *line, void *ctx)
+{
+    Output *out = (Output *)ctx;
+    out->len += snprintf(out->text + out->len, MAX_OUTPUT - out->len, "%s\n", line);
+    if (strcmp(line, "Checksum\t") == 0)
+        out->frames++;
+    return 0;
+}
+
+static unsigned long counter(const char *name)
+{
+    for (Metric *m = Metric::first(); m; m = m->get_next())
+        if (strcmp(m->get_name(), name) == 0)
+            return ((MetricCounter *)m)->get();
+    return 0;
+}
+
+// append CR LF <fields> CR LF "Checksum" TAB <byte>, the fields separated by CR LF
+static int add_frame(char *stream, int len, const char *fields)
+{
+    int start = len;
+    len += snprintf(stream + len, MAX_STREAM - len, "\r\n%s\r\nChecksum\t", fields);
+    unsigned char sum = 0;
+    for (int i = start; i < len; i++)
+        sum += (unsigned char)stream[i];
+    stream[len] = (char)(256 - sum);
+    return len + 1;
+}
+
+// fields of a frame whose checksum byte is c, the values chosen to get it
+static void find_frame(char *fields, int size, unsigned char c)
+{
+    char frame[MAX_STREAM];
+    for (int v = 0; v < 100000; v++)
+    {
+        for (int soc = 0; soc < 1000; soc++)
+        {
+            snprintf(fields, size, "V\t%d\r\nSOC\t%d", v, soc);
+            if ((unsigned char)frame[add_frame(frame, 0, fields) - 1] == c)
+                return;
+        }
+    }
+    printf("No frame with checksum byte {0x%02x}\n", c);
+    errors++;
+}
+
+static int add_text(char *stream, int len, const char *text)
+{
+    return len + snprintf(stream + len, MAX_STREAM - len, "%s", text);
+}
+
+// the lines of a valid frame as handed over by the port
+static void expect_frame(Output &expected, const char *fields)
+{
+    const char *p = fields;
+    while (*p)
+    {
+        const char *e = strstr(p, "\r\n");
+        int n = e ? (int)(e - p) : (int)strlen(p);
+        expected.len += snprintf(expected.text + expected.len, MAX_OUTPUT - expected.len, "%.*s\n", n, p);
+        p += n + (e ? 2 : 0);
+    }
+    expected.len += snprintf(expected.text + expected.len, MAX_OUTPUT - expected.len, "Checksum\t\n");
+    expected.frames++;
+}
+
+static void check(const char *name, const char *stream, int len, const Output &expected,
+                  unsigned long resyncs, unsigned long lost)
+{
+    // the whole stream at once, then split in two at every offset, then one byte at a time
+    for (int split = 0; split <= len + 1; split++)
+    {
+        TestPort port;
+        Output out;
+        out.len = 0;
+        out.frames = 0;
+        out.text[0] = 0;
+        port.set_handler(on_line, &out);
+        unsigned long resyncs0 = counter("vedirect_resyncs_total");
+        unsigned long lost0 = counter("vedirect_bytes_lost_total");
+
+        if (split <= len)
+        {
+            port.feed((const unsigned char *)stream, split);
+            port.feed((const unsigned char *)stream + split, len - split);
+        }
+        else
+        {
+            for (int i = 0; i < len; i++)
+                port.feed((const unsigned char *)stream + i, 1);
+        }
+
+        unsigned long r = counter("vedirect_resyncs_total") - resyncs0;
+        unsigned long l = counter("vedirect_bytes_lost_total") - lost0;
+        if (out.frames != expected.frames || strcmp(out.text, expected.text) != 0 || r != resyncs || l != lost)
+        {
+            if (errors++ < 10)
+                printf("%s split at %d: {%d frames} {%lu resyncs} {%lu bytes lost}, expected {%d} {%lu} {%lu}\n%s\n",
+                       name, split, out.frames, r, l, expected.frames, resyncs, lost, out.text);
+        }
+    }
+    printf("%s {%d bytes} {%d frames} {%lu resyncs} {%lu bytes lost}\n", name, len, expected.frames, resyncs, lost);
+}
+
+static void reset(Output &expected)
+{
+    expected.len = 0;
+    expected.frames = 0;
+    expected.text[0] = 0;
+}
+
+int main()
+{
+    static char stream[MAX_STREAM];
+    static Output expected;
+    const char *f1 = "PID\t0xA389\r\nV\t12800\r\nI\t-1500\r\nP\t-19\r\nSOC\t876";
+    const char *f2 = "PID\t0xA389\r\nV\t12790\r\nI\t-1520\r\nP\t-19\r\nSOC\t875";
+    const char *f3 = "H1\t-55000\r\nH2\t-12000\r\nH3\t-80000\r\nH4\t3\r\nH5\t0";
+    int len, start;
+
+    // clean frames
+    reset(expected);
+    len = add_frame(stream, 0, f1);
+    len = add_frame(stream, len, f2);
+    len = add_frame(stream, len, f3);
+    expect_frame(expected, f1);
+    expect_frame(expected, f2);
+    expect_frame(expected, f3);
+    check("clean", stream, len, expected, 0, 0);
+
+    // the "Checksum" line of the first frame is lost: the repeated PID starts the second one
+    reset(expected);
+    len = add_text(stream, 0, "\r\n");
+    len = add_text(stream, len, f1);
+    start = len;
+    len = add_frame(stream, len, f2);
+    expect_frame(expected, f2);
+    check("repeated label", stream, len, expected, 1, start);
+
+    // a damaged "Checksum" line ends the first frame, the next one starts at its CR LF
+    reset(expected);
+    len = add_text(stream, 0, "\r\n");
+    len = add_text(stream, len, f1);
+    len = add_text(stream, len, "\r\nChecksun\tx");
+    start = len;
+    len = add_frame(stream, len, f2);
+    expect_frame(expected, f2);
+    check("damaged checksum", stream, len, expected, 1, start);
+
+    // checksum bytes that are delimiters themselves
+    reset(expected);
+    char lf[64], tab[64];
+    find_frame(lf, sizeof(lf), '\n');
+    find_frame(tab, sizeof(tab), '\t');
+    len = add_frame(stream, 0, lf);
+    len = add_frame(stream, len, tab);
+    len = add_frame(stream, len, f3);
+    expect_frame(expected, lf);
+    expect_frame(expected, tab);
+    expect_frame(expected, f3);
+    check("delimiter checksum", stream, len, expected, 0, 0);
+
+    // async hex messages between the frames are skipped, not lost
+    reset(expected);
+    len = add_frame(stream, 0, f1);
+    len = add_text(stream, len, ":A4F100100C8\n");
+    len = add_frame(stream, len, f2);
+    len = add_text(stream, len, ":8F0ED0064\n:A4F100100C8\n");
+    len = add_frame(stream, len, f3);
+    expect_frame(expected, f1);
+    expect_frame(expected, f2);
+    expect_frame(expected, f3);
+    check("hex messages", stream, len, expected, 0, 0);
+
+    // a byte lost in the middle of a frame: the checksum fails and the frame is dropped
+    reset(expected);
+    len = add_frame(stream, 0, f1);
+    start = len;
+    len = add_frame(stream, len, f2);
+    memmove(stream + start + 8, stream + start + 9, len - start - 9);
+    len--;
+    int lost = len - start;
+    len = add_frame(stream, len, f3);
+    expect_frame(expected, f1);
+    expect_frame(expected, f3);
+    check("lost byte", stream, len, expected, 0, lost);
+
+    // noise before the first frame
+    reset(expected);
+    len = add_text(stream, 0, "\x01\xff garbage");
+    start = len;
+    len = add_frame(stream, len, f1);
+    expect_frame(expected, f1);
+    check("leading noise", stream, len, expected, 0, start);
+
+    if (errors)
+        printf("%d errors\n", errors);
+    else
+        printf("OK\n");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+# (C) 2022, Andrea Boni
+# This file is part of n2k_battery_monitor.
+# n2k_battery_monitor is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# NMEARouter is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+
+# Replay a capture twice on the virtual clock (-S), a second apart, and compare
+# what the runs produce: the log without the replay speed, and the archive
+# Usage: cmake -DGATEWAY=<vedirectN2K> -DCAPTURE=<file> -DWORK_DIR=<dir> -P replay_twice.cmake
+
+foreach(run 1 2)
+  if(run EQUAL 2)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E sleep 1)
+  endif()
+  file(REMOVE_RECURSE ${WORK_DIR}/${run})
+  file(MAKE_DIRECTORY ${WORK_DIR}/${run})
+  # the same archive path in both runs, it is written in the log
+  file(REMOVE_RECURSE ${WORK_DIR}/archive)
+  file(MAKE_DIRECTORY ${WORK_DIR}/archive)
+  execute_process(COMMAND ${GATEWAY} -S -B 10 -a ${WORK_DIR}/archive/values -R ${CAPTURE} null
+    OUTPUT_VARIABLE log
+    ERROR_VARIABLE log
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Replay ${run} failed {${result}}\n${log}")
+  endif()
+  # the only wall clock figures are the replay speed
+  string(REGEX REPLACE "Replay complete[^\n]*\n" "" log "${log}")
+  string(REGEX REPLACE "Simulated {[^\n]*\n" "" log "${log}")
+  file(WRITE ${WORK_DIR}/${run}/log.txt "${log}")
+  file(RENAME ${WORK_DIR}/archive ${WORK_DIR}/${run}/archive)
+endforeach()
+
+foreach(file log.txt archive/values.dat archive/values.idx)
+  execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/1/${file} ${WORK_DIR}/2/${file}
+    RESULT_VARIABLE different)
+  if(different)
+    message(FATAL_ERROR "The replays differ in {${file}}, see ${WORK_DIR}")
+  endif()
+endforeach()
+message("Replays match")
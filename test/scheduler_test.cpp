@@ -0,0 +1,134 @@
+/*
+(C) 2022, Andrea Boni
+This file is part of n2k_battery_monitor.
+n2k_battery_monitor is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+NMEARouter is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with n2k_battery_monitor.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Randomised check of the timer wheel: next_timeout() against the earliest
+// deadline found by brute force, and every timer fired exactly at its deadline
+// Usage: vedirect_scheduler_test [<seed>] [<steps>]
+
+#include "Scheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_TIMERS 32
+#define MAX_WAIT 60000L
+
+struct TestTimer
+{
+    SchedulerTimer timer;
+    unsigned long expected;
+    int fired;
+};
+
+static TestTimer timers[N_TIMERS];
+static unsigned long now;
+static int errors = 0;
+
+static void on_timer(void *ctx)
+{
+    TestTimer *t = (TestTimer *)ctx;
+    if (t->expected != now)
+    {
+        if (errors++ < 10)
+            printf("Timer %d due at %lu fired at %lu\n", (int)(t - timers), t->expected, now);
+    }
+    t->expected += t->timer.get_period();
+    t->fired++;
+}
+
+static unsigned long random_delay()
+{
+    // mostly short, some beyond each level of the wheel and a few beyond the horizon
+    switch (rand() % 8)
+    {
+    case 0: return rand() % 64;
+    case 1: return rand() % 4096;
+    case 2: return rand() % 262144;
+    case 3: return rand() % 16777216;
+    case 4: return 16777216UL + rand() % 16777216;
+    default: return rand() % 2000;
+    }
+}
+
+static long earliest(long max_wait)
+{
+    long best = max_wait;
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        if (timers[i].timer.is_active())
+        {
+            long wait = (long)(timers[i].expected - now);
+            if (wait < best)
+                best = wait < 0 ? 0 : wait;
+        }
+    }
+    return best;
+}
+
+int main(int argc, const char **argv)
+{
+    unsigned int seed = (argc > 1) ? atoi(argv[1]) : 1;
+    long steps = (argc > 2) ? atol(argv[2]) : 200000;
+    srand(seed);
+
+    // start close to the 32 bits wrap and not aligned to any level
+    now = 0xFFFFFFFFUL - 100000 - rand() % 1000;
+    Scheduler scheduler;
+    scheduler.start(now);
+    for (int i = 0; i < N_TIMERS; i++)
+        timers[i].timer.set_callback(on_timer, &timers[i]);
+
+    long fired = 0;
+    for (long step = 0; step < steps && errors < 10; step++)
+    {
+        // re-arm or cancel a few timers, as callbacks and the main loop do
+        for (int k = rand() % 3; k > 0; k--)
+        {
+            TestTimer &t = timers[rand() % N_TIMERS];
+            if (rand() % 4 == 0)
+                scheduler.cancel(t.timer);
+            else
+            {
+                unsigned long delay = random_delay();
+                unsigned long period = (rand() % 3 == 0) ? 1 + random_delay() : 0;
+                scheduler.schedule(t.timer, delay, period);
+                t.expected = now + (delay ? delay : 1);
+            }
+        }
+
+        long wait = scheduler.next_timeout(now, MAX_WAIT);
+        long expected = earliest(MAX_WAIT);
+        if (wait != expected)
+        {
+            if (errors++ < 10)
+                printf("At %lu next_timeout {%ld}, earliest deadline in {%ld}\n", now, wait, expected);
+            wait = expected;
+        }
+
+        // sleep the whole wait or wake up earlier, as on a readable fd
+        now += (wait && rand() % 2) ? 1 + rand() % wait : wait;
+        fired += scheduler.run(now);
+    }
+
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        if (timers[i].timer.is_active() && (long)(timers[i].expected - now) < 0)
+        {
+            if (errors++ < 10)
+                printf("Timer %d due at %lu not fired at %lu\n", i, timers[i].expected, now);
+        }
+    }
+    printf("Seed {%u}: {%ld} steps, {%ld} timers fired, {%d} errors\n", seed, steps, fired, errors);
+    return errors ? 1 : 0;
+}